@@ -0,0 +1,110 @@
+#include "Codec.h"
+
+#include <algorithm>
+#include <cstring>
+
+static size_t prefixBytes(uint8_t dst_len) { return (dst_len + 7) / 8; }
+
+static void put16(uint8_t *buf, uint16_t v) {
+  buf[0] = v >> 8;
+  buf[1] = v & 0xff;
+}
+
+static void put32(uint8_t *buf, uint32_t v) {
+  put16(buf, v >> 16);
+  put16(buf + 2, v & 0xffff);
+}
+
+static uint16_t get16(const uint8_t *buf) { return (buf[0] << 8) | buf[1]; }
+
+static uint32_t get32(const uint8_t *buf) {
+  return ((uint32_t)get16(buf) << 16) | get16(buf + 2);
+}
+
+size_t encodedEntrySize(const Entry &entry) {
+  return 1 + prefixBytes(entry.dst_len) + 1;
+}
+
+size_t encodePacket(const PacketHeader &header, const Entry *entries,
+                    size_t count, uint8_t *buf, size_t cap, size_t &len) {
+  len = 0;
+  if (cap < wireHeaderSize)
+    return 0;
+
+  size_t pos = wireHeaderSize;
+  size_t n = 0;
+  while (n < count && n < UINT16_MAX) {
+    const Entry &entry = entries[n];
+    if (pos + encodedEntrySize(entry) > cap)
+      break;
+
+    size_t bytes = prefixBytes(entry.dst_len);
+    buf[pos++] = entry.dst_len;
+    std::memcpy(&buf[pos], &entry.dst, bytes);
+    pos += bytes;
+    buf[pos++] = (uint8_t)std::min(std::max(entry.metric, 0), 255);
+    n++;
+  }
+
+  buf[0] = wireVersion;
+  buf[1] = header.type;
+  put16(&buf[2], n);
+  put32(&buf[4], header.baseSeq);
+  put32(&buf[8], header.seq);
+  setPacketFragment(buf, header.fragment, header.fragments);
+
+  len = pos;
+  return n;
+}
+
+void setPacketFragment(uint8_t *buf, uint16_t fragment, uint16_t fragments) {
+  put16(&buf[12], fragment);
+  put16(&buf[14], fragments);
+}
+
+size_t maxDecodedEntries(size_t len) {
+  return len < wireHeaderSize ? 0 : (len - wireHeaderSize) / 2;
+}
+
+int decodePacket(const uint8_t *buf, size_t len, PacketHeader &header,
+                 Entry *out, size_t cap) {
+  if (len < wireHeaderSize || buf[0] != wireVersion)
+    return -1;
+
+  header.type = buf[1];
+  header.baseSeq = get32(&buf[4]);
+  header.seq = get32(&buf[8]);
+  header.fragment = get16(&buf[12]);
+  header.fragments = get16(&buf[14]);
+  if (header.type > packetRequest || header.fragment >= header.fragments)
+    return -1;
+
+  size_t count = get16(&buf[2]);
+  if (count > cap)
+    return -1;
+
+  size_t pos = wireHeaderSize;
+  for (size_t i = 0; i < count; i++) {
+    if (pos >= len || buf[pos] > 32)
+      return -1;
+    uint8_t dst_len = buf[pos++];
+
+    size_t bytes = prefixBytes(dst_len);
+    if (pos + bytes + 1 > len)
+      return -1;
+
+    Entry &entry = out[i];
+    entry = Entry{};
+    std::memcpy(&entry.dst, &buf[pos], bytes);
+    if (dst_len % 8)
+      ((uint8_t *)&entry.dst)[bytes - 1] &= 0xff << (8 - dst_len % 8);
+    pos += bytes;
+
+    entry.dst_len = dst_len;
+    entry.metric = buf[pos++];
+  }
+
+  if (pos != len)
+    return -1;
+  return count;
+}
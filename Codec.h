@@ -0,0 +1,57 @@
+#pragma once
+#include "Entry.h"
+
+#include <cstddef>
+#include <cstdint>
+
+// Wire format (all multi-byte fields in network byte order):
+//
+//   header: version (1) | type (1) | entry count (2) | base seq (4) |
+//           seq (4) | fragment (2) | fragment count (2)
+//   entry:  prefix length (1) | significant prefix bytes (0-4) | metric (1)
+//
+// Only the first ceil(dst_len / 8) bytes of the destination are sent.
+// Metrics above 255 are clamped.
+//
+// A full dump carries the whole table as of table version seq. A delta
+// carries the entries changed between base seq and seq. Both may be split
+// into several fragments sharing the same sequence numbers. A request asks
+// the receiver for a full dump and carries no entries.
+
+static const uint8_t wireVersion = 2;
+static const size_t wireHeaderSize = 16;
+static const size_t wireMaxEntrySize = 1 + 4 + 1;
+
+enum PacketType : uint8_t {
+  packetFull = 0,
+  packetDelta = 1,
+  packetRequest = 2,
+};
+
+struct PacketHeader {
+  uint8_t type;
+  uint32_t baseSeq;
+  uint32_t seq;
+  uint16_t fragment;
+  uint16_t fragments;
+};
+
+size_t encodedEntrySize(const Entry &entry);
+
+// Encodes header and entries[0..count) into buf until it is full. Returns the
+// number of entries consumed and stores the number of bytes written in len.
+size_t encodePacket(const PacketHeader &header, const Entry *entries,
+                    size_t count, uint8_t *buf, size_t cap, size_t &len);
+
+// Rewrites the fragment fields of an already encoded packet.
+void setPacketFragment(uint8_t *buf, uint16_t fragment, uint16_t fragments);
+
+// Returns the largest number of entries a packet of len bytes can carry.
+size_t maxDecodedEntries(size_t len);
+
+// Decodes a packet into header and out, which must have room for cap
+// entries. Only dst, dst_len and metric are filled in. Returns the number of
+// entries decoded or -1 if the packet is malformed, has an unknown version or
+// does not fit.
+int decodePacket(const uint8_t *buf, size_t len, PacketHeader &header,
+                 Entry *out, size_t cap);
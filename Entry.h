@@ -3,6 +3,8 @@
 
 #include <cstdint>
 
+static const int infinityMetric = 16;
+
 struct Entry {
   in_addr dst;
   uint8_t dst_len;
@@ -10,3 +12,8 @@ struct Entry {
   int oif;
   int metric;
 };
+
+struct NextHop {
+  in_addr gateway;
+  int oif;
+};
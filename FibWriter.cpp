@@ -0,0 +1,184 @@
+#include "FibWriter.h"
+#include "RoutingTable.h"
+#include "utils.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <unordered_set>
+
+// Until a withdrawal of a route still installed is tried again, and how
+// many times before giving up, as each try dumps the kernel's routes.
+static const auto withdrawRetryDelay = std::chrono::seconds{1};
+static const unsigned maxWithdrawRetries = 3;
+
+FibWriter::FibWriter() {
+  this->thread = std::thread{[=]() { writeLoop(); }};
+}
+
+FibWriter::~FibWriter() {
+  {
+    std::lock_guard<std::mutex> lock{mutex};
+    stopping = true;
+  }
+  cv.notify_one();
+  thread.join();
+}
+
+void FibWriter::submit(const std::vector<RouteChange> &changes) {
+  if (changes.empty())
+    return;
+
+  auto now = std::chrono::steady_clock::now();
+  {
+    std::lock_guard<std::mutex> lock{mutex};
+    for (const auto &change : changes) {
+      retries.erase(routeKey(change.entry));
+      auto it = pendingIndex.emplace(routeKey(change.entry), pending.size());
+      if (it.second) {
+        pending.push_back(Pending{change, now, 0});
+      } else {
+        pending[it.first->second].change = change;
+        pending[it.first->second].retries = 0;
+        counters.coalesced++;
+      }
+    }
+  }
+  cv.notify_one();
+}
+
+FibWriter::Stats FibWriter::stats() {
+  std::lock_guard<std::mutex> lock{mutex};
+  Stats stats = counters;
+  stats.depth = pending.size() + retries.size();
+  stats.oldestPending = std::chrono::microseconds{0};
+  if (!pending.empty()) {
+    // Pending changes are in submission order.
+    stats.oldestPending =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - pending[0].submitted);
+  }
+  return stats;
+}
+
+void FibWriter::writeLoop() {
+  std::vector<Pending> batch;
+  std::unique_lock<std::mutex> lock{mutex};
+  auto ready = [this] { return stopping || !pending.empty(); };
+  while (true) {
+    if (retries.empty()) {
+      cv.wait(lock, ready);
+    } else if (!cv.wait_until(lock, retryAt, ready)) {
+      for (auto &retry : retries) {
+        pendingIndex[retry.first] = pending.size();
+        pending.push_back(retry.second);
+      }
+      retries.clear();
+    }
+    if (pending.empty())
+      return;
+
+    batch.clear();
+    batch.swap(pending);
+    pendingIndex.clear();
+
+    lock.unlock();
+    apply(batch);
+    lock.lock();
+  }
+}
+
+void FibWriter::apply(const std::vector<Pending> &batch) {
+  std::vector<RouteChange> changes;
+  changes.reserve(batch.size());
+  for (const auto &p : batch)
+    changes.push_back(p.change);
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<int> errors;
+  try {
+    errors = netlink.applyRoutes(changes);
+  } catch (const std::runtime_error &e) {
+    std::cerr << "Cannot apply kernel route changes: " << e.what()
+              << std::endl;
+    errors.assign(changes.size(), EIO);
+  }
+  auto done = std::chrono::steady_clock::now();
+
+  // A withdrawn route may already be gone, e.g. with its interface, but
+  // ESRCH also comes back if the request matched no route while one is
+  // still there; the route dump tells which.
+  std::vector<size_t> notFound;
+  for (size_t i = 0; i < batch.size(); i++) {
+    if (changes[i].remove && errors[i] == ESRCH)
+      notFound.push_back(i);
+  }
+  std::vector<size_t> retry;
+  if (!notFound.empty()) {
+    std::unordered_set<uint64_t> installed;
+    bool checked = true;
+    try {
+      for (const auto &route : netlink.getRoutes()) {
+        if (route.table == RT_TABLE_MAIN && route.protocol == ownRouteProtocol)
+          installed.insert(routeKey(route.dst, route.dst_len));
+      }
+    } catch (const std::runtime_error &e) {
+      std::cerr << "Cannot check withdrawn routes: " << e.what() << std::endl;
+      checked = false;
+    }
+    for (size_t i : notFound) {
+      if (checked && installed.count(routeKey(changes[i].entry)) == 0)
+        errors[i] = 0;
+      else
+        retry.push_back(i);
+    }
+  }
+
+  size_t failed = 0;
+  for (size_t i = 0; i < batch.size(); i++) {
+    if (errors[i] == 0)
+      continue;
+    failed++;
+    const Entry &entry = changes[i].entry;
+    std::cerr << "Cannot " << (changes[i].remove ? "withdraw" : "install")
+              << " route " << to_string(entry.dst) << "/"
+              << (int)entry.dst_len << ": " << std::strerror(errors[i])
+              << std::endl;
+  }
+  auto lag = std::chrono::duration_cast<std::chrono::microseconds>(
+      done - batch[0].submitted);
+  std::cerr << "Applied " << changes.size() << " kernel route changes ("
+            << failed << " failed) in "
+            << std::chrono::duration_cast<std::chrono::microseconds>(
+                   done - start)
+                   .count()
+            << " us, " << lag.count() << " us after submission"
+            << std::endl;
+
+  std::lock_guard<std::mutex> lock{mutex};
+  counters.written += changes.size() - failed;
+  counters.failed += failed;
+  counters.lastBatchLag = lag;
+
+  // Withdrawals of routes still installed are tried again later, unless a
+  // newer change for the prefix comes in meanwhile.
+  bool retrying = false;
+  for (size_t i : retry) {
+    uint64_t key = routeKey(changes[i].entry);
+    if (pendingIndex.count(key) != 0)
+      continue;
+    if (batch[i].retries == maxWithdrawRetries) {
+      const Entry &entry = changes[i].entry;
+      std::cerr << "Giving up withdrawing route " << to_string(entry.dst)
+                << "/" << (int)entry.dst_len << " after "
+                << maxWithdrawRetries << " retries" << std::endl;
+      continue;
+    }
+    Pending &p = retries.emplace(key, batch[i]).first->second;
+    p.retries++;
+    retrying = true;
+  }
+  if (retrying)
+    retryAt = std::chrono::steady_clock::now() + withdrawRetryDelay;
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include "NetlinkRouteSocket.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Installs routes in the kernel from a thread of its own, so that slow
+// netlink requests never hold up the threads that decide on routes.
+//
+// Pending changes are keyed by prefix and a newer change replaces an older
+// one still waiting, so a route that flaps while the kernel is busy is
+// written once, in its final state. The writer takes everything pending at
+// once and sends it as one netlink batch. A withdrawal the kernel answers
+// with ESRCH while the route is still installed is tried again a bit later,
+// a few times.
+class FibWriter {
+public:
+  FibWriter();
+  ~FibWriter();
+  FibWriter(const FibWriter &) = delete;
+  FibWriter &operator=(const FibWriter &) = delete;
+
+  void submit(const std::vector<RouteChange> &changes);
+
+  struct Stats {
+    // Changes waiting to be written, or tried again.
+    size_t depth;
+    // How long the oldest of them has been waiting.
+    std::chrono::microseconds oldestPending;
+    // Longest time from submission to acknowledgement in the last batch.
+    std::chrono::microseconds lastBatchLag;
+    uint64_t written;
+    uint64_t failed;
+    // Changes replaced by a newer one for the same prefix before written.
+    uint64_t coalesced;
+  };
+  Stats stats();
+
+private:
+  struct Pending {
+    RouteChange change;
+    // Submission of the oldest change replaced by this one.
+    std::chrono::steady_clock::time_point submitted;
+    // Times a withdrawal has been tried again.
+    unsigned retries;
+  };
+
+  void writeLoop();
+  void apply(const std::vector<Pending> &batch);
+
+  NetlinkRouteSocket netlink;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<Pending> pending;
+  // Position in pending by prefix (dst << 8 | dst_len).
+  std::unordered_map<uint64_t, size_t> pendingIndex;
+  // Withdrawals to try again at retryAt, by prefix.
+  std::unordered_map<uint64_t, Pending> retries;
+  std::chrono::steady_clock::time_point retryAt;
+  bool stopping = false;
+  Stats counters{};
+
+  std::thread thread;
+};
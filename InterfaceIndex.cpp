@@ -0,0 +1,32 @@
+#include "InterfaceIndex.h"
+#include "RouteKernels.h"
+#include "utils.h"
+
+#include <algorithm>
+
+void InterfaceIndex::add(in_addr net, uint8_t net_len, int oif) {
+  if (net_len > 32)
+    throw std::runtime_error("invalid subnet length");
+
+  auto pos = std::upper_bound(lens.begin(), lens.end(), net_len,
+                              [](uint8_t a, uint8_t b) { return a > b; });
+  size_t i = pos - lens.begin();
+
+  uint32_t mask = prefixMask(net_len);
+  networks.insert(networks.begin() + i, ntohl(net.s_addr) & mask);
+  masks.insert(masks.begin() + i, mask);
+  lens.insert(pos, net_len);
+  oifs.insert(oifs.begin() + i, oif);
+}
+
+int InterfaceIndex::find(in_addr addr) const {
+  uint32_t addrh = ntohl(addr.s_addr);
+  for (size_t i = 0; i < networks.size(); i += 64) {
+    size_t n = std::min<size_t>(64, networks.size() - i);
+    uint64_t matched;
+    matchPrefix(&networks[i], &masks[i], n, addrh, &matched);
+    if (matched != 0)
+      return oifs[i + __builtin_ctzll(matched)];
+  }
+  return -1;
+}
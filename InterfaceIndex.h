@@ -0,0 +1,22 @@
+#pragma once
+#include <netinet/ip.h>
+
+#include <cstdint>
+#include <vector>
+
+// Maps addresses to the enabled interface whose subnet covers them. Subnets
+// are kept as packed network/mask columns ordered from the longest prefix to
+// the shortest, and matched with RouteKernels::matchPrefix, so the first
+// match is the most specific subnet.
+class InterfaceIndex {
+public:
+  void add(in_addr net, uint8_t net_len, int oif);
+  // Returns the oif of the longest subnet covering addr, or -1.
+  int find(in_addr addr) const;
+
+private:
+  std::vector<uint32_t> networks;
+  std::vector<uint32_t> masks;
+  std::vector<uint8_t> lens;
+  std::vector<int> oifs;
+};
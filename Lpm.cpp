@@ -0,0 +1,115 @@
+#include "Lpm.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+static const size_t tbl24Size = (size_t)1 << 24;
+
+Lpm::Lpm() {
+  // Parts of the address space not covered by any route share one zeroed
+  // chunk.
+  static const ChunkRef zero = std::make_shared<Chunk>(Chunk{});
+  tbl24.assign(tbl24Size / chunkSize, zero);
+}
+
+std::shared_ptr<const Lpm> Lpm::snapshot() const {
+  return std::shared_ptr<const Lpm>{new Lpm(*this)};
+}
+
+uint32_t &Lpm::writable(std::vector<ChunkRef> &table, size_t i) {
+  ChunkRef &chunk = table[i >> chunkBits];
+  if (chunk.use_count() != 1)
+    chunk = std::make_shared<Chunk>(*chunk);
+  return chunk->entries[i & (chunkSize - 1)];
+}
+
+// Overwrites entries resolved by prefixes no longer than len (or, if
+// onlyExact, by prefixes of exactly len), descending into second level
+// groups.
+void Lpm::fill(std::vector<ChunkRef> &table, size_t first, size_t count,
+               uint8_t len, uint32_t value, bool onlyExact) {
+  for (size_t i = first; i < first + count; i++) {
+    uint32_t e = entry(table, i);
+    if (e & extFlag) {
+      fill(tbl8, (size_t)(e & ~extFlag) << 8, 256, len, value, onlyExact);
+    } else if ((onlyExact ? depth(e) == len : depth(e) <= len) &&
+               e != value) {
+      writable(table, i) = value;
+    }
+  }
+}
+
+uint32_t Lpm::allocGroup(uint32_t value) {
+  uint32_t group;
+  if (!freeGroups.empty()) {
+    group = freeGroups.back();
+    freeGroups.pop_back();
+  } else {
+    group = tbl8Groups++;
+    if (group >= extFlag >> 8)
+      throw std::runtime_error("lpm: out of tbl8 groups");
+    if (((size_t)group << 8) >> chunkBits == tbl8.size())
+      tbl8.push_back(std::make_shared<Chunk>());
+  }
+  for (size_t i = 0; i < 256; i++) {
+    writable(tbl8, ((size_t)group << 8) + i) = value;
+  }
+  return group;
+}
+
+void Lpm::insert(in_addr dst, uint8_t dst_len, uint32_t id) {
+  if (id > maxId || dst_len > 32)
+    throw std::runtime_error("lpm: bad route");
+
+  uint32_t dsth = ntohl(dst.s_addr);
+  uint32_t value = pack(id, dst_len);
+
+  if (dst_len <= 24) {
+    uint32_t first = dst_len == 0 ? 0 : (dsth >> 8) & ~((1u << (24 - dst_len)) - 1);
+    fill(tbl24, first, (size_t)1 << (24 - dst_len), dst_len, value, false);
+    return;
+  }
+
+  uint32_t e = entry(tbl24, dsth >> 8);
+  if (!(e & extFlag)) {
+    e = extFlag | allocGroup(e);
+    writable(tbl24, dsth >> 8) = e;
+  }
+
+  uint32_t first = dsth & 0xff & ~((1u << (32 - dst_len)) - 1);
+  fill(tbl8, ((size_t)(e & ~extFlag) << 8) | first,
+       (size_t)1 << (32 - dst_len), dst_len, value, false);
+}
+
+void Lpm::remove(in_addr dst, uint8_t dst_len, long parentId,
+                 uint8_t parentLen) {
+  if (dst_len > 32)
+    throw std::runtime_error("lpm: bad route");
+
+  uint32_t dsth = ntohl(dst.s_addr);
+  uint32_t value = parentId < 0 ? 0 : pack(parentId, parentLen);
+
+  if (dst_len <= 24) {
+    uint32_t first = dst_len == 0 ? 0 : (dsth >> 8) & ~((1u << (24 - dst_len)) - 1);
+    fill(tbl24, first, (size_t)1 << (24 - dst_len), dst_len, value, true);
+    return;
+  }
+
+  uint32_t e = entry(tbl24, dsth >> 8);
+  if (!(e & extFlag))
+    return;
+
+  size_t group = e & ~extFlag;
+  uint32_t first = dsth & 0xff & ~((1u << (32 - dst_len)) - 1);
+  fill(tbl8, (group << 8) | first, (size_t)1 << (32 - dst_len), dst_len,
+       value, true);
+
+  // Collapse the group back into the first level entry once no route longer
+  // than /24 is left in it.
+  for (size_t i = 0; i < 256; i++) {
+    if (depth(entry(tbl8, (group << 8) | i)) > 24)
+      return;
+  }
+  writable(tbl24, dsth >> 8) = entry(tbl8, group << 8);
+  freeGroups.push_back(group);
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <netinet/ip.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// DIR-24-8 longest-prefix-match table mapping addresses to route ids
+// (routing table slots). A lookup is one access to the 2^24-entry first
+// level table, plus one to a 256-entry second level group for addresses
+// covered by prefixes longer than /24.
+//
+// Each table entry packs the id and prefix length of the route it resolves
+// to, so routes can be added and removed incrementally without consulting
+// the routing table, except for the covering route that takes over after a
+// removal.
+class Lpm {
+public:
+  static const uint32_t maxId = (1 << 25) - 1;
+
+  Lpm();
+  Lpm &operator=(const Lpm &) = delete;
+
+  void insert(in_addr dst, uint8_t dst_len, uint32_t id);
+  // Removes the route for dst/dst_len. Addresses it covered resolve to
+  // parentId/parentLen afterwards, or to nothing if parentId is negative.
+  void remove(in_addr dst, uint8_t dst_len, long parentId, uint8_t parentLen);
+
+  // Returns an immutable copy that may be read from any thread without
+  // locking. It shares all chunks with the table, which copies a chunk the
+  // first time it changes it afterwards.
+  std::shared_ptr<const Lpm> snapshot() const;
+
+  // Returns the id of the longest prefix covering addr, or -1.
+  long lookup(in_addr addr) const {
+    uint32_t addrh = ntohl(addr.s_addr);
+    uint32_t e = entry(tbl24, addrh >> 8);
+    if (e & extFlag)
+      e = entry(tbl8, ((e & ~extFlag) << 8) | (addrh & 0xff));
+    return e == 0 ? -1 : (long)(e & maxId);
+  }
+
+private:
+  static const uint32_t extFlag = 1u << 31;
+
+  // Both levels are split into chunks shared with snapshots.
+  static const size_t chunkBits = 12;
+  static const size_t chunkSize = (size_t)1 << chunkBits;
+  struct Chunk {
+    uint32_t entries[chunkSize];
+  };
+  using ChunkRef = std::shared_ptr<Chunk>;
+
+  Lpm(const Lpm &) = default;
+
+  static uint32_t pack(uint32_t id, uint8_t len) {
+    return ((uint32_t)(len + 1) << 25) | id;
+  }
+  static int depth(uint32_t e) { return (int)(e >> 25) - 1; }
+  static uint32_t entry(const std::vector<ChunkRef> &table, size_t i) {
+    return table[i >> chunkBits]->entries[i & (chunkSize - 1)];
+  }
+  static uint32_t &writable(std::vector<ChunkRef> &table, size_t i);
+
+  void fill(std::vector<ChunkRef> &table, size_t first, size_t count,
+            uint8_t len, uint32_t value, bool onlyExact);
+  uint32_t allocGroup(uint32_t value);
+
+  std::vector<ChunkRef> tbl24;
+  std::vector<ChunkRef> tbl8;
+  uint32_t tbl8Groups = 0;
+  std::vector<uint32_t> freeGroups;
+};
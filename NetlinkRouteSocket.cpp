@@ -1,12 +1,15 @@
 #include "NetlinkRouteSocket.h"
 
-#include "utils.h"
-
 #include <arpa/inet.h>
 #include <linux/rtnetlink.h>
+#include <net/if.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
 #include <cstring>
 #include <iostream>
 
@@ -38,6 +41,13 @@ struct RtaInt {
 
 static_assert(sizeof(RtaInt) == sizeof(struct rtattr) + 4);
 
+struct RtNextHop {
+  struct rtnexthop rtnh;
+  struct RtaInaddr rta_gateway;
+};
+
+static_assert(sizeof(RtNextHop) == sizeof(struct rtnexthop) + 8);
+
 struct RtResponseHeader {
   struct nlmsghdr nlh;
   struct rtmsg rtm;
@@ -55,8 +65,14 @@ struct RtRequest {
 static RtMessage repack_rt_message(const RtResponseHeader &rth) {
   const struct rtmsg &rtm = rth.rtm;
 
-  RtMessage msg;
+  RtMessage msg{};
+  msg.msg_type = rth.nlh.nlmsg_type;
   msg.dst_len = rtm.rtm_dst_len;
+  msg.table = rtm.rtm_table;
+  msg.protocol = rtm.rtm_protocol;
+  msg.scope = rtm.rtm_scope;
+  msg.type = rtm.rtm_type;
+  msg.tos = rtm.rtm_tos;
 
   int len = RTM_PAYLOAD(&rth.nlh);
   for (rtattr *rta = (rtattr *)RTM_RTA(&rtm); RTA_OK(rta, len);
@@ -74,21 +90,128 @@ static RtMessage repack_rt_message(const RtResponseHeader &rth) {
     case RTA_METRICS:
       msg.metric = ((RtaInt *)rta)->i;
       break;
+    case RTA_PRIORITY:
+      msg.priority = ((RtaInt *)rta)->i;
+      break;
+    case RTA_MULTIPATH: {
+      int nhLen = RTA_PAYLOAD(rta);
+      for (rtnexthop *rtnh = (rtnexthop *)RTA_DATA(rta); RTNH_OK(rtnh, nhLen);
+           nhLen -= RTNH_ALIGN(rtnh->rtnh_len), rtnh = RTNH_NEXT(rtnh)) {
+        NextHop nextHop{in_addr_any, rtnh->rtnh_ifindex};
+        int attrLen = rtnh->rtnh_len - RTNH_LENGTH(0);
+        for (rtattr *attr = RTNH_DATA(rtnh); RTA_OK(attr, attrLen);
+             attr = RTA_NEXT(attr, attrLen)) {
+          if (attr->rta_type == RTA_GATEWAY)
+            nextHop.gateway = ((RtaInaddr *)attr)->ina;
+        }
+        msg.nextHops.push_back(nextHop);
+      }
+      break;
+    }
     }
   }
 
   return msg;
 }
 
-static std::vector<RtMessage> recv_rt_response(int sfd) {
-  std::vector<RtMessage> rv;
+// Large enough for any message the kernel sends on a route socket, dump
+// batches included.
+static const size_t recvBufSize = 64 * 1024;
+
+static const int socketBufSize = 1024 * 1024;
+
+// Batches are sent in datagrams of up to sendBatchSize requests, with as
+// many requests awaiting their acknowledgement as the receive buffer has
+// room for at ackBufCost bytes each (an acknowledgement's buffer accounting
+// includes the socket buffer overhead, several times the message itself).
+static const size_t sendBatchSize = 256;
+static const size_t ackBufCost = 1024;
+
+// Sets a socket buffer size, beyond the rmem_max/wmem_max limits if the
+// process may (CAP_NET_ADMIN), and returns the size the kernel granted.
+static int setBufferSize(int sfd, int forceOption, int option, int size) {
+  if (setsockopt(sfd, SOL_SOCKET, forceOption, &size, sizeof size) != 0 &&
+      setsockopt(sfd, SOL_SOCKET, option, &size, sizeof size) != 0)
+    return -1;
+  int granted = 0;
+  socklen_t len = sizeof granted;
+  if (getsockopt(sfd, SOL_SOCKET, option, &granted, &len) != 0)
+    return -1;
+  return granted;
+}
+
+NetlinkRouteSocket::NetlinkRouteSocket() : recvBuf(recvBufSize) {
+  if ((sfd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) ==
+      -1) {
+    throw std::runtime_error("socket [NETLINK_ROUTE]");
+  }
+
+  // Room for the acknowledgements of many requests in flight.
+  int rcvBuf = setBufferSize(sfd, SO_RCVBUFFORCE, SO_RCVBUF, socketBufSize);
+  if (rcvBuf < 0 ||
+      setBufferSize(sfd, SO_SNDBUFFORCE, SO_SNDBUF, socketBufSize) < 0) {
+    close(sfd);
+    throw std::runtime_error("setsockopt [netlink buffers]");
+  }
+  this->maxInFlight = std::max<size_t>(1, rcvBuf / ackBufCost);
+
+  // Errors then only echo the header of the failed request, not all of it.
+  // Older kernels lack the option, which only costs buffer space.
+  int capAck = 1;
+  setsockopt(sfd, SOL_NETLINK, NETLINK_CAP_ACK, &capAck, sizeof capAck);
 
+  struct sockaddr_nl snl {};
+  snl.nl_family = AF_NETLINK;
+  socklen_t snlLen = sizeof snl;
+  if (bind(sfd, (sockaddr *)&snl, sizeof snl) != 0 ||
+      getsockname(sfd, (sockaddr *)&snl, &snlLen) != 0) {
+    close(sfd);
+    throw std::runtime_error("bind [netlink]");
+  }
+
+  this->portId = snl.nl_pid;
+  this->seq = 0;
+}
+
+NetlinkRouteSocket::~NetlinkRouteSocket() { close(sfd); }
+
+// Reads one datagram into recvBuf and returns its length, or -1 with errno
+// set to ENOBUFS if the kernel dropped messages because the receive buffer
+// was full, or, with MSG_DONTWAIT in flags, to EAGAIN if there is none.
+ssize_t NetlinkRouteSocket::tryReceiveDatagram(int flags) {
   while (true) {
-    char buf[8192] = {};
-    int len = recv(sfd, buf, sizeof buf, 0);
+    ssize_t len = recv(sfd, recvBuf.data(), recvBuf.size(), MSG_TRUNC | flags);
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == ENOBUFS || errno == EAGAIN)
+        return -1;
+      throw std::runtime_error("recv [netlink]");
+    }
+    if ((size_t)len > recvBuf.size())
+      throw std::runtime_error("netlink message truncated");
+    return len;
+  }
+}
+
+size_t NetlinkRouteSocket::receiveDatagram() {
+  ssize_t len = tryReceiveDatagram(0);
+  if (len < 0)
+    throw std::runtime_error("recv [netlink]: "s + std::strerror(errno));
+  return len;
+}
 
-    for (nlmsghdr *nlh = (nlmsghdr *)buf; NLMSG_OK(nlh, len);
-         nlh = NLMSG_NEXT(nlh, len)) {
+// Reads the answer to request seq, skipping what is left of answers to
+// earlier requests that failed half way.
+std::vector<RtMessage> NetlinkRouteSocket::receive(uint32_t seq) {
+  std::vector<RtMessage> rv;
+
+  while (true) {
+    int remaining = receiveDatagram();
+    for (nlmsghdr *nlh = (nlmsghdr *)recvBuf.data(); NLMSG_OK(nlh, remaining);
+         nlh = NLMSG_NEXT(nlh, remaining)) {
+      if (nlh->nlmsg_seq != seq || nlh->nlmsg_pid != portId)
+        continue;
 
       if (nlh->nlmsg_type == NLMSG_DONE)
         return rv;
@@ -111,25 +234,28 @@ static std::vector<RtMessage> recv_rt_response(int sfd) {
       rv.push_back(repack_rt_message(*rth));
     }
   }
-
-  return rv;
 }
 
-static std::vector<RtMessage> send_rt_request(const RtMessage &msg) {
-  int sfd = socket(PF_NETLINK, SOCK_RAW, NETLINK_ROUTE); // TODO: error handling
+static std::vector<char> build_rt_request(const RtMessage &msg, uint32_t seq,
+                                          uint32_t pid) {
+  size_t multipathLen = 0;
+  if (msg.nextHops.size() > 1)
+    multipathLen = RTA_LENGTH(msg.nextHops.size() * sizeof(RtNextHop));
 
-  RtRequest req{};
+  std::vector<char> buf(sizeof(RtRequest) + multipathLen);
+  RtRequest &req = *(RtRequest *)buf.data();
 
   auto &nlh = req.nlh;
-  nlh.nlmsg_len = sizeof(RtRequest);
+  nlh.nlmsg_len = buf.size();
   nlh.nlmsg_type = msg.msg_type;
   nlh.nlmsg_flags = msg.flags;
-  nlh.nlmsg_seq = 0;
-  nlh.nlmsg_pid = getpid();
+  nlh.nlmsg_seq = seq;
+  nlh.nlmsg_pid = pid;
 
   auto &rtm = req.rtm;
   rtm.rtm_family = AF_INET;
   rtm.rtm_dst_len = msg.dst_len;
+  rtm.rtm_tos = msg.tos;
   rtm.rtm_table = RT_TABLE_MAIN;
   rtm.rtm_protocol = msg.protocol;
   rtm.rtm_scope = msg.scope;
@@ -151,35 +277,67 @@ static std::vector<RtMessage> send_rt_request(const RtMessage &msg) {
   req.rta_metric.rta.rta_len = sizeof req.rta_metric;
   req.rta_metric.i = msg.metric;
 
-  struct sockaddr_nl snl {};
-  snl.nl_family = AF_NETLINK;
-  snl.nl_pid = 0;
+  if (multipathLen != 0) {
+    rtattr *rta = (rtattr *)&buf[sizeof(RtRequest)];
+    rta->rta_type = RTA_MULTIPATH;
+    rta->rta_len = multipathLen;
+    RtNextHop *rtnh = (RtNextHop *)RTA_DATA(rta);
+    for (const auto &nextHop : msg.nextHops) {
+      rtnh->rtnh.rtnh_len = sizeof(RtNextHop);
+      rtnh->rtnh.rtnh_ifindex = nextHop.oif;
+      rtnh->rta_gateway.rta.rta_type = RTA_GATEWAY;
+      rtnh->rta_gateway.rta.rta_len = sizeof rtnh->rta_gateway;
+      rtnh->rta_gateway.ina = nextHop.gateway;
+      rtnh++;
+    }
+  }
 
-  if (sendto(sfd, (void *)&req, req.nlh.nlmsg_len, 0, (sockaddr *)&snl,
-             sizeof snl) < 0)
-    throw std::runtime_error("sendto");
+  // A request without a next hop (e.g. a delete by prefix) ends after
+  // RTA_DST, or after RTA_PRIORITY if it names one, so that the kernel
+  // matches any next hop and metric.
+  if (multipathLen == 0 && msg.gateway.s_addr == INADDR_ANY && msg.oif == 0) {
+    size_t len = offsetof(RtRequest, rta_gateway);
+    if (msg.priority != 0) {
+      RtaInt *rta_priority = (RtaInt *)&buf[len];
+      rta_priority->rta.rta_type = RTA_PRIORITY;
+      rta_priority->rta.rta_len = sizeof *rta_priority;
+      rta_priority->i = msg.priority;
+      len += sizeof *rta_priority;
+    }
+    nlh.nlmsg_len = len;
+    buf.resize(len);
+  }
 
-  auto rv = recv_rt_response(sfd);
+  return buf;
+}
+
+std::vector<RtMessage> NetlinkRouteSocket::request(const RtMessage &msg) {
+  uint32_t requestSeq = ++seq;
+  std::vector<char> buf = build_rt_request(msg, requestSeq, portId);
+
+  struct sockaddr_nl snl {};
+  snl.nl_family = AF_NETLINK;
 
-  close(sfd);
+  while (sendto(sfd, buf.data(), buf.size(), 0, (sockaddr *)&snl,
+                sizeof snl) < 0) {
+    if (errno != EINTR)
+      throw std::runtime_error("sendto [netlink]");
+  }
 
-  return rv;
+  return receive(requestSeq);
 }
 
 std::vector<RtMessage> NetlinkRouteSocket::getRoutes() {
-  RtMessage msg;
+  RtMessage msg{};
   msg.msg_type = RTM_GETROUTE;
   msg.flags = NLM_F_REQUEST | NLM_F_ROOT;
 
-  return send_rt_request(msg);
+  return request(msg);
 }
 
-void NetlinkRouteSocket::setRoute(Entry entry) {
-  std::cerr << "Setting route: " << to_string(entry.dst) << " via "
-            << to_string(entry.gateway) << " dev " << entry.oif << " metric "
-            << entry.metric << std::endl;
-
-  RtMessage msg;
+static RtMessage set_route_message(const Entry &entry,
+                                   const std::vector<NextHop> &nextHops) {
+  RtMessage msg{};
   msg.msg_type = RTM_NEWROUTE;
   msg.flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_REPLACE | NLM_F_ACK;
   msg.dst = entry.dst;
@@ -187,9 +345,257 @@ void NetlinkRouteSocket::setRoute(Entry entry) {
   msg.gateway = entry.gateway;
   msg.oif = entry.oif;
   msg.metric = entry.metric;
-  msg.protocol = RTPROT_STATIC;
+  msg.protocol = ownRouteProtocol;
   msg.scope = RT_SCOPE_UNIVERSE;
   msg.type = RTN_UNICAST;
+  msg.nextHops = nextHops;
+  return msg;
+}
+
+static RtMessage delete_route_message(const RouteChange &change) {
+  const Entry &entry = change.entry;
+  RtMessage msg{};
+  msg.msg_type = RTM_DELROUTE;
+  msg.flags = NLM_F_REQUEST | NLM_F_ACK;
+  msg.dst = entry.dst;
+  msg.dst_len = entry.dst_len;
+  // Whatever the next hops: the kernel only deletes a multipath route
+  // through the first of them, and the route installed may have others
+  // than the entry by now.
+  msg.gateway = in_addr_any;
+  msg.oif = 0;
+  msg.metric = 0;
+  msg.protocol = ownRouteProtocol;
+  msg.scope = RT_SCOPE_NOWHERE;
+  msg.type = RTN_UNICAST;
+  msg.tos = change.tos;
+  msg.priority = change.priority;
+  return msg;
+}
+
+std::vector<int>
+NetlinkRouteSocket::applyRoutes(const std::vector<RouteChange> &changes) {
+  std::vector<int> errors(changes.size());
+  std::vector<bool> sent(changes.size());
+  std::vector<bool> acked(changes.size());
+  uint32_t firstSeq = seq + 1;
+  seq += changes.size();
+
+  struct sockaddr_nl snl {};
+  snl.nl_family = AF_NETLINK;
+
+  // Changes to send, in order; unacknowledged ones are put back in front
+  // after an overflow.
+  std::vector<size_t> queue(changes.size());
+  for (size_t i = 0; i < queue.size(); i++)
+    queue[i] = i;
+  size_t next = 0;
+  size_t inFlight = 0;
+  size_t ackCount = 0;
+
+  std::vector<std::vector<char>> requests;
+  std::vector<iovec> iovs;
+  while (ackCount < changes.size()) {
+    while (next < queue.size() && inFlight < maxInFlight) {
+      requests.clear();
+      iovs.clear();
+      while (next < queue.size() && inFlight < maxInFlight &&
+             requests.size() < sendBatchSize) {
+        size_t i = queue[next++];
+        const RouteChange &change = changes[i];
+        RtMessage msg = change.remove
+                            ? delete_route_message(change)
+                            : set_route_message(change.entry, change.nextHops);
+        requests.push_back(build_rt_request(msg, firstSeq + i, portId));
+        sent[i] = true;
+        inFlight++;
+      }
+      for (auto &request : requests) {
+        iovs.push_back(iovec{request.data(), request.size()});
+      }
+
+      msghdr hdr{};
+      hdr.msg_name = &snl;
+      hdr.msg_namelen = sizeof snl;
+      hdr.msg_iov = iovs.data();
+      hdr.msg_iovlen = iovs.size();
+      while (sendmsg(sfd, &hdr, 0) < 0) {
+        if (errno != EINTR)
+          throw std::runtime_error("sendmsg [netlink]");
+      }
+    }
 
-  auto rv = send_rt_request(msg);
+    // After an overflow, what is left in the buffer is read without
+    // waiting: the kernel handles route requests within sendmsg, so every
+    // acknowledgement not in the buffer by then is lost.
+    bool overflow = false;
+    while (true) {
+      ssize_t len = tryReceiveDatagram(overflow ? MSG_DONTWAIT : 0);
+      if (len < 0) {
+        if (errno == ENOBUFS) {
+          overflow = true;
+          continue;
+        }
+        break;
+      }
+
+      int remaining = len;
+      for (nlmsghdr *nlh = (nlmsghdr *)recvBuf.data();
+           NLMSG_OK(nlh, remaining); nlh = NLMSG_NEXT(nlh, remaining)) {
+        uint32_t i = nlh->nlmsg_seq - firstSeq;
+        if (nlh->nlmsg_pid != portId || nlh->nlmsg_type != NLMSG_ERROR ||
+            i >= changes.size() || !sent[i] || acked[i])
+          continue;
+        errors[i] = -((RtError *)nlh)->nle.error;
+        acked[i] = true;
+        ackCount++;
+        inFlight--;
+      }
+      if (!overflow)
+        break;
+    }
+    if (!overflow)
+      continue;
+
+    // Resends the changes whose outcome is unknown, with a smaller window.
+    // Installs replace whatever is there; deletes of routes already gone
+    // fail with ESRCH, which callers check.
+    std::vector<size_t> resend;
+    for (size_t n = 0; n < next; n++) {
+      size_t i = queue[n];
+      if (!acked[i]) {
+        resend.push_back(i);
+        sent[i] = false;
+      }
+    }
+    std::cerr << "Netlink acknowledgements lost, resending " << resend.size()
+              << " route changes" << std::endl;
+    resend.insert(resend.end(), queue.begin() + next, queue.end());
+    queue.swap(resend);
+    next = 0;
+    inFlight = 0;
+    maxInFlight = std::max<size_t>(1, maxInFlight / 2);
+  }
+
+  return errors;
+}
+
+// Kernel notifications come in bursts, e.g. when an interface with many
+// routes goes down; the buffer absorbs them while the service is busy. It
+// is only that large with CAP_NET_ADMIN, rmem_max caps it otherwise.
+static const int eventBufSize = 4 * 1024 * 1024;
+
+NetlinkEventSocket::NetlinkEventSocket() : recvBuf(recvBufSize) {
+  if ((sfd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) ==
+      -1) {
+    throw std::runtime_error("socket [NETLINK_ROUTE]");
+  }
+
+  int rcvBuf = setBufferSize(sfd, SO_RCVBUFFORCE, SO_RCVBUF, eventBufSize);
+  if (rcvBuf < 0) {
+    close(sfd);
+    throw std::runtime_error("setsockopt [netlink buffers]");
+  }
+  if (rcvBuf < eventBufSize)
+    std::cerr << "Kernel notification buffer limited to " << rcvBuf
+              << " bytes by net.core.rmem_max" << std::endl;
+
+  struct sockaddr_nl snl {};
+  snl.nl_family = AF_NETLINK;
+  if (bind(sfd, (sockaddr *)&snl, sizeof snl) != 0) {
+    close(sfd);
+    throw std::runtime_error("bind [netlink]");
+  }
+
+  for (int group : {RTNLGRP_IPV4_ROUTE, RTNLGRP_LINK, RTNLGRP_IPV4_IFADDR}) {
+    if (setsockopt(sfd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group,
+                   sizeof group) != 0) {
+      close(sfd);
+      throw std::runtime_error("setsockopt [NETLINK_ADD_MEMBERSHIP]");
+    }
+  }
+}
+
+NetlinkEventSocket::~NetlinkEventSocket() { close(sfd); }
+
+static bool parse_event(const nlmsghdr *nlh, NetlinkEvent &event) {
+  event = NetlinkEvent{};
+  switch (nlh->nlmsg_type) {
+  case RTM_NEWROUTE:
+  case RTM_DELROUTE: {
+    const RtResponseHeader *rth = (const RtResponseHeader *)nlh;
+    if (rth->rtm.rtm_family != AF_INET ||
+        rth->rtm.rtm_table != RT_TABLE_MAIN)
+      return false;
+    event.type = nlh->nlmsg_type == RTM_NEWROUTE
+                     ? NetlinkEventType::newRoute
+                     : NetlinkEventType::deleteRoute;
+    event.route = repack_rt_message(*rth);
+    return true;
+  }
+
+  case RTM_NEWLINK:
+  case RTM_DELLINK: {
+    const ifinfomsg *ifi = (const ifinfomsg *)NLMSG_DATA(nlh);
+    bool up = nlh->nlmsg_type == RTM_NEWLINK && (ifi->ifi_flags & IFF_UP) &&
+              (ifi->ifi_flags & IFF_RUNNING);
+    event.type = up ? NetlinkEventType::linkUp : NetlinkEventType::linkDown;
+    event.oif = ifi->ifi_index;
+    return true;
+  }
+
+  case RTM_NEWADDR:
+  case RTM_DELADDR: {
+    const ifaddrmsg *ifa = (const ifaddrmsg *)NLMSG_DATA(nlh);
+    if (ifa->ifa_family != AF_INET)
+      return false;
+    event.type = nlh->nlmsg_type == RTM_NEWADDR
+                     ? NetlinkEventType::newAddress
+                     : NetlinkEventType::deleteAddress;
+    event.oif = ifa->ifa_index;
+    event.addr_len = ifa->ifa_prefixlen;
+    int len = IFA_PAYLOAD(nlh);
+    for (rtattr *rta = IFA_RTA(ifa); RTA_OK(rta, len);
+         rta = RTA_NEXT(rta, len)) {
+      // IFA_ADDRESS is the peer on point-to-point links.
+      if (rta->rta_type == IFA_LOCAL ||
+          (rta->rta_type == IFA_ADDRESS && event.addr.s_addr == 0))
+        event.addr = ((RtaInaddr *)rta)->ina;
+    }
+    return true;
+  }
+  }
+  return false;
+}
+
+bool NetlinkEventSocket::receive(std::vector<NetlinkEvent> &events) {
+  bool complete = true;
+  int flags = 0;
+  while (true) {
+    ssize_t len = recv(sfd, recvBuf.data(), recvBuf.size(), flags | MSG_TRUNC);
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return complete;
+      if (errno == ENOBUFS) {
+        complete = false;
+        flags = MSG_DONTWAIT;
+        continue;
+      }
+      throw std::runtime_error("recv [netlink events]");
+    }
+    if ((size_t)len > recvBuf.size())
+      throw std::runtime_error("netlink message truncated");
+
+    int remaining = len;
+    for (nlmsghdr *nlh = (nlmsghdr *)recvBuf.data(); NLMSG_OK(nlh, remaining);
+         nlh = NLMSG_NEXT(nlh, remaining)) {
+      NetlinkEvent event;
+      if (parse_event(nlh, event))
+        events.push_back(event);
+    }
+    // Drain what else is queued without blocking.
+    flags = MSG_DONTWAIT;
+  }
 }
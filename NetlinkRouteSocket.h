@@ -1,8 +1,20 @@
 #pragma once
 #include "Entry.h"
 
+#include <linux/rtnetlink.h>
+#include <sys/types.h>
+
 #include <vector>
 
+// Protocol the daemon's routes are installed with, which tells them apart
+// from routes added by hand or by other daemons: reconciliation deletes the
+// routes of this protocol it did not learn, and deletes match by prefix and
+// protocol. So it must be a number no one else uses, unlike RTPROT_RIP
+// (189), which FRR and BIRD install their RIP routes with. 201 is neither
+// assigned in linux/rtnetlink.h nor used by FRR (186-198); `ip route` shows
+// it as "proto 201".
+const uint8_t ownRouteProtocol = 201;
+
 struct RtMessage {
   uint16_t msg_type;
   uint16_t flags;
@@ -11,13 +23,95 @@ struct RtMessage {
   in_addr gateway;
   int oif;
   int metric;
+  uint8_t table;
   uint8_t protocol;
   uint8_t scope;
   uint8_t type;
+  // Tell apart routes for the same prefix in one table.
+  uint8_t tos;
+  uint32_t priority;
+  // Equal-cost next hops of a multipath route, sent as RTA_MULTIPATH.
+  std::vector<NextHop> nextHops;
 };
 
+// One change of a batch: the route is installed through nextHops (through
+// the entry's gateway and oif if there is only one), or deleted if remove
+// is set. A delete matches the daemon's route for the prefix, or only the
+// one with the given tos and priority if either is set.
+struct RouteChange {
+  bool remove;
+  Entry entry;
+  std::vector<NextHop> nextHops;
+  uint8_t tos;
+  uint32_t priority;
+};
+
+// Long-lived NETLINK_ROUTE socket. Requests are numbered and answers are
+// matched to them by sequence number, so one socket serves every request
+// for the lifetime of the daemon. Errors reported by the kernel are thrown
+// as std::runtime_error.
 class NetlinkRouteSocket {
 public:
+  NetlinkRouteSocket();
+  ~NetlinkRouteSocket();
+  NetlinkRouteSocket(const NetlinkRouteSocket &) = delete;
+  NetlinkRouteSocket &operator=(const NetlinkRouteSocket &) = delete;
+
   std::vector<RtMessage> getRoutes();
-  void setRoute(Entry entry);
+  // Sends the changes in order, many per sendmsg and without waiting for
+  // each acknowledgement, and returns the error of each one (an errno value,
+  // 0 on success). A failed change does not stop the others. Changes whose
+  // acknowledgement the kernel dropped are sent again.
+  std::vector<int> applyRoutes(const std::vector<RouteChange> &changes);
+
+private:
+  std::vector<RtMessage> request(const RtMessage &msg);
+  std::vector<RtMessage> receive(uint32_t seq);
+  ssize_t tryReceiveDatagram(int flags);
+  size_t receiveDatagram();
+
+  int sfd;
+  uint32_t portId;
+  uint32_t seq;
+  // Requests applyRoutes keeps awaiting acknowledgement, from the size of
+  // the receive buffer; halved whenever acknowledgements are lost anyway.
+  size_t maxInFlight;
+  std::vector<char> recvBuf;
+};
+
+enum class NetlinkEventType {
+  newRoute,
+  deleteRoute,
+  linkUp,
+  linkDown,
+  newAddress,
+  deleteAddress,
+};
+
+// A change of kernel state: a route of the main table (route), or the state
+// or an IPv4 address (addr/addr_len) of an interface (oif).
+struct NetlinkEvent {
+  NetlinkEventType type;
+  RtMessage route;
+  int oif;
+  in_addr addr;
+  uint8_t addr_len;
+};
+
+// NETLINK_ROUTE socket subscribed to the kernel's notifications of IPv4
+// route, link and IPv4 address changes.
+class NetlinkEventSocket {
+public:
+  NetlinkEventSocket();
+  ~NetlinkEventSocket();
+  NetlinkEventSocket(const NetlinkEventSocket &) = delete;
+  NetlinkEventSocket &operator=(const NetlinkEventSocket &) = delete;
+
+  // Waits for notifications and appends all that have arrived. Returns false
+  // if the kernel dropped some because the socket buffer overflowed.
+  bool receive(std::vector<NetlinkEvent> &events);
+
+private:
+  int sfd;
+  std::vector<char> recvBuf;
 };
@@ -0,0 +1,250 @@
+#include "RouteAggregator.h"
+
+#include "utils.h"
+
+#include <algorithm>
+
+const uint32_t RouteAggregator::noValue;
+const uint32_t RouteAggregator::mixedValue;
+const uint8_t RouteAggregator::noMetric;
+
+static uint64_t prefixKey(uint32_t addr, uint8_t len) {
+  return ((uint64_t)addr << 8) | len;
+}
+
+static int bitAt(uint32_t addr, uint8_t depth) {
+  return addr >> (31 - depth) & 1;
+}
+
+RouteAggregator::RouteAggregator(const std::vector<Prefix> &summaries,
+                                 bool autoSummarize)
+    : interfaceSets(1) {
+  this->hasSummaries = !summaries.empty();
+  this->autoSummarize = autoSummarize;
+  interfaceSetIds[{}] = 0;
+
+  nodes.push_back(Node{{0, 0}, 0, 0, false, noMetric, noValue, noValue,
+                       noValue});
+  for (const auto &summary : summaries) {
+    if (summary.dst_len > 32)
+      throw std::runtime_error("invalid summary prefix length");
+    uint32_t addr = ntohl(summary.dst.s_addr) & prefixMask(summary.dst_len);
+    uint32_t n = 0;
+    for (uint8_t depth = 0; depth < summary.dst_len; depth++) {
+      n = addChild(n, bitAt(addr, depth));
+    }
+    nodes[n].summary = true;
+  }
+}
+
+uint32_t RouteAggregator::internInterfaces(const std::vector<int> &oifs) {
+  auto it = interfaceSetIds.find(oifs);
+  if (it != interfaceSetIds.end())
+    return it->second;
+
+  uint32_t id = interfaceSets.size();
+  interfaceSets.push_back(oifs);
+  interfaceSetIds[oifs] = id;
+  return id;
+}
+
+// Returns the child of n on the given side, creating it if needed.
+uint32_t RouteAggregator::addChild(uint32_t n, int bit) {
+  if (nodes[n].child[bit] != 0)
+    return nodes[n].child[bit];
+
+  Node node{{0, 0},
+            nodes[n].addr | ((uint32_t)bit << (31 - nodes[n].len)),
+            (uint8_t)(nodes[n].len + 1),
+            false,
+            noMetric,
+            noValue,
+            noValue,
+            noValue};
+  uint32_t c;
+  if (!freeNodes.empty()) {
+    c = freeNodes.back();
+    freeNodes.pop_back();
+    nodes[c] = node;
+  } else {
+    c = nodes.size();
+    nodes.push_back(node);
+  }
+  nodes[n].child[bit] = c;
+  return c;
+}
+
+// Returns the node for the prefix, or -1.
+long RouteAggregator::find(uint32_t addr, uint8_t len) const {
+  uint32_t n = 0;
+  for (uint8_t depth = 0; depth < len; depth++) {
+    n = nodes[n].child[bitAt(addr, depth)];
+    if (n == 0)
+      return -1;
+  }
+  return n;
+}
+
+void RouteAggregator::update(in_addr dst, uint8_t dst_len, int metric,
+                             const std::vector<int> &oifs) {
+  metric = std::min(std::max(metric, 0), infinityMetric);
+  set(dst, dst_len, pack(metric, internInterfaces(oifs)));
+}
+
+void RouteAggregator::remove(in_addr dst, uint8_t dst_len) {
+  set(dst, dst_len, noValue);
+}
+
+void RouteAggregator::set(in_addr dst, uint8_t dst_len, uint32_t route) {
+  if (dst_len > 32)
+    throw std::runtime_error("invalid prefix length");
+  uint32_t addr = ntohl(dst.s_addr) & prefixMask(dst_len);
+
+  std::vector<uint32_t> path{0};
+  for (uint8_t depth = 0; depth < dst_len; depth++) {
+    uint32_t n = path.back();
+    if (route == noValue && nodes[n].child[bitAt(addr, depth)] == 0)
+      return;
+    path.push_back(addChild(n, bitAt(addr, depth)));
+  }
+
+  nodes[path.back()].route = route;
+  for (size_t i = path.size(); i-- > 0;) {
+    recompute(nodes[path[i]]);
+  }
+
+  // Only the nodes on the path and their children can start or stop being
+  // advertised: nodes further down keep their values, so they stay covered
+  // by a child that covers them or exposed under a child that does not.
+  bool coveredAbove = false;
+  for (size_t i = 0; i < path.size(); i++) {
+    uint32_t n = path[i];
+    readvertise(n, coveredAbove);
+    coveredAbove |= covers(nodes[n]);
+    for (int bit = 0; bit < 2; bit++) {
+      uint32_t c = nodes[n].child[bit];
+      if (c != 0 && (i + 1 == path.size() || c != path[i + 1]))
+        readvertise(c, coveredAbove);
+    }
+  }
+
+  for (size_t i = path.size() - 1; i > 0; i--) {
+    Node &node = nodes[path[i]];
+    if (node.route != noValue || node.summary || node.child[0] != 0 ||
+        node.child[1] != 0)
+      break;
+    Node &parent = nodes[path[i - 1]];
+    parent.child[parent.child[0] == path[i] ? 0 : 1] = 0;
+    freeNodes.push_back(path[i]);
+  }
+}
+
+void RouteAggregator::recompute(Node &n) {
+  n.minMetric = n.route == noValue ? noMetric : metricOf(n.route);
+  uint32_t effective[2];
+  for (int bit = 0; bit < 2; bit++) {
+    uint32_t c = n.child[bit];
+    if (c != 0)
+      n.minMetric = std::min(n.minMetric, nodes[c].minMetric);
+    // Parts of the range without more specific routes use this node's.
+    effective[bit] =
+        c == 0 || nodes[c].value == noValue ? n.route : nodes[c].value;
+  }
+
+  if (n.summary)
+    n.value = n.minMetric == noMetric ? noValue : pack(n.minMetric, 0);
+  else if (n.len == 32)
+    n.value = n.route;
+  else
+    n.value = effective[0] == effective[1] ? effective[0] : mixedValue;
+}
+
+// Whether the node is advertised in place of everything below it.
+bool RouteAggregator::covers(const Node &n) const {
+  if (n.summary)
+    return n.value != noValue;
+  return autoSummarize && n.value != noValue && n.value != mixedValue;
+}
+
+uint32_t RouteAggregator::advertisement(const Node &n,
+                                        bool coveredAbove) const {
+  if (coveredAbove)
+    return noValue;
+  return covers(n) ? n.value : n.route;
+}
+
+void RouteAggregator::readvertise(uint32_t n, bool coveredAbove) {
+  Node &node = nodes[n];
+  uint32_t value = advertisement(node, coveredAbove);
+  if (value == node.advertised)
+    return;
+
+  setAdvertised(node, value);
+  changed.insert({prefixKey(node.addr, node.len), node.advertised});
+  node.advertised = value;
+}
+
+// Updates advertisedRoutes for the node.
+void RouteAggregator::setAdvertised(const Node &n, uint32_t value) {
+  in_addr dst{htonl(n.addr)};
+  if (value == noValue) {
+    advertisedRoutes.remove(advertisedRoutes.find(dst, n.len));
+    return;
+  }
+
+  const std::vector<int> &oifs = interfaceSets[interfacesOf(value)];
+  in_addr any{INADDR_ANY};
+  Entry entry{dst, n.len, any, oifs.empty() ? 0 : oifs[0], metricOf(value)};
+  size_t slot = advertisedRoutes.upsert(entry);
+  if (oifs.size() > 1) {
+    std::vector<NextHop> nextHops;
+    for (int oif : oifs) {
+      nextHops.push_back(NextHop{any, oif});
+    }
+    advertisedRoutes.setNextHops(slot, nextHops);
+  }
+}
+
+void RouteAggregator::appendEntry(
+    uint32_t addr, uint8_t len, uint32_t value, std::vector<Entry> &entries,
+    std::map<size_t, std::vector<int>> &multipathOifs) const {
+  const std::vector<int> &oifs = interfaceSets[interfacesOf(value)];
+  if (oifs.size() > 1)
+    multipathOifs[entries.size()] = oifs;
+
+  Entry entry{};
+  entry.dst.s_addr = htonl(addr);
+  entry.dst_len = len;
+  entry.oif = oifs.empty() ? 0 : oifs[0];
+  entry.metric = metricOf(value);
+  entries.push_back(entry);
+}
+
+void RouteAggregator::takeChanges(
+    std::vector<Entry> &entries,
+    std::map<size_t, std::vector<int>> &multipathOifs) {
+  for (const auto &change : changed) {
+    uint32_t addr = change.first >> 8;
+    uint8_t len = change.first & 0xff;
+    long n = find(addr, len);
+    uint32_t value = n < 0 ? noValue : nodes[n].advertised;
+    if (value == change.second)
+      continue;
+    if (value == noValue)
+      value = pack(infinityMetric, 0);
+    appendEntry(addr, len, value, entries, multipathOifs);
+  }
+  changed.clear();
+}
+
+void RouteAggregator::clearChanges(std::vector<Entry> &withdrawn) {
+  std::map<size_t, std::vector<int>> none;
+  for (const auto &change : changed) {
+    uint32_t addr = change.first >> 8;
+    uint8_t len = change.first & 0xff;
+    long n = find(addr, len);
+    if ((n < 0 || nodes[n].advertised == noValue) && change.second != noValue)
+      appendEntry(addr, len, pack(infinityMetric, 0), withdrawn, none);
+  }
+  changed.clear();
+}
@@ -0,0 +1,122 @@
+#pragma once
+#include "Entry.h"
+#include "RoutingTable.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+struct Prefix {
+  in_addr dst;
+  uint8_t dst_len;
+};
+
+// Turns the routing table into the set of routes to advertise, replacing
+// routes with shorter prefixes where possible:
+//
+// - A configured summary prefix is advertised, with the best metric among
+//   them, instead of all routes it covers, as long as there is any.
+// - With autoSummarize, a prefix whose whole range is covered by routes
+//   with the same metric and next hop interfaces is advertised instead of
+//   those routes, so e.g. 10.0.0.0/24 and 10.0.1.0/24 become 10.0.0.0/23.
+//   This never changes the metric neighbors get for any address.
+//
+// Routes are kept in a binary trie in which every node knows whether its
+// range is uniformly covered, and which node is advertised. A route update
+// only revisits the nodes on its path and their children, and changes to
+// the advertised set are collected as they happen, so deltas cost time
+// proportional to the routes that changed rather than to the table size.
+// The advertised set itself is kept in a RoutingTable as it changes, with
+// the interfaces of a route as its next hops, so that full dumps take a
+// snapshot of it rather than walking the trie.
+class RouteAggregator {
+public:
+  RouteAggregator(const std::vector<Prefix> &summaries, bool autoSummarize);
+
+  // Whether the advertised set can differ from the routing table at all.
+  bool enabled() const { return hasSummaries || autoSummarize; }
+
+  // Sets the metric and next hop interfaces (sorted) of the route for
+  // dst/dst_len.
+  void update(in_addr dst, uint8_t dst_len, int metric,
+              const std::vector<int> &oifs);
+  void remove(in_addr dst, uint8_t dst_len);
+
+  // Returns the advertised routes, each with next hops on all of its
+  // interfaces (none for summaries); split horizon applies to aggregates
+  // like to the routes they replace.
+  std::shared_ptr<const RoutingTableSnapshot> snapshot() {
+    return advertisedRoutes.snapshot();
+  }
+  size_t size() const { return advertisedRoutes.size(); }
+
+  bool hasChanges() const { return !changed.empty(); }
+  // Appends the advertised routes that changed since the previous call, and
+  // those no longer advertised with an infinite metric, so that neighbors
+  // drop them and fall back to the aggregate covering them, if any. Changes
+  // undone in the meantime are left out.
+  void takeChanges(std::vector<Entry> &entries,
+                   std::map<size_t, std::vector<int>> &multipathOifs);
+  // Forgets the changes after a full dump, appending only the withdrawn
+  // routes, which the dump does not mention.
+  void clearChanges(std::vector<Entry> &withdrawn);
+
+private:
+  // Node values pack a metric and an interface set id; see pack().
+  static const uint32_t noValue = UINT32_MAX;
+  static const uint32_t mixedValue = UINT32_MAX - 1;
+  static const uint8_t noMetric = UINT8_MAX;
+
+  struct Node {
+    uint32_t child[2];
+    uint32_t addr; // host byte order
+    uint8_t len;
+    bool summary;
+    uint8_t minMetric;
+    // Value of the route with exactly this prefix.
+    uint32_t route;
+    // Value shared by the whole range, noValue if nothing in it is routed,
+    // mixedValue if parts differ.
+    uint32_t value;
+    // Value this node is advertised with, noValue if it is not.
+    uint32_t advertised;
+  };
+
+  static uint32_t pack(int metric, uint32_t interfaces) {
+    return (interfaces << 5) | (uint32_t)metric;
+  }
+  static int metricOf(uint32_t value) { return value & 31; }
+  static uint32_t interfacesOf(uint32_t value) { return value >> 5; }
+
+  uint32_t internInterfaces(const std::vector<int> &oifs);
+  uint32_t addChild(uint32_t n, int bit);
+  void set(in_addr dst, uint8_t dst_len, uint32_t route);
+  void recompute(Node &n);
+  bool covers(const Node &n) const;
+  uint32_t advertisement(const Node &n, bool coveredAbove) const;
+  void readvertise(uint32_t n, bool coveredAbove);
+  void setAdvertised(const Node &n, uint32_t value);
+  long find(uint32_t addr, uint8_t len) const;
+  void appendEntry(uint32_t addr, uint8_t len, uint32_t value,
+                   std::vector<Entry> &entries,
+                   std::map<size_t, std::vector<int>> &multipathOifs) const;
+
+  bool hasSummaries;
+  bool autoSummarize;
+
+  // Node 0 is the root (0.0.0.0/0); 0 as a child index means no child.
+  std::vector<Node> nodes;
+  std::vector<uint32_t> freeNodes;
+  RoutingTable advertisedRoutes;
+
+  // Interned sorted interface sets. Id 0 is the empty set of summaries,
+  // which split horizon never matches.
+  std::vector<std::vector<int>> interfaceSets;
+  std::map<std::vector<int>, uint32_t> interfaceSetIds;
+
+  // Prefixes (addr << 8 | len) whose advertisement changed, with the value
+  // neighbors last heard for them.
+  std::map<uint64_t, uint32_t> changed;
+};
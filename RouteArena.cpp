@@ -0,0 +1,92 @@
+#include "RouteArena.h"
+
+#include <sys/mman.h>
+
+#include <iostream>
+#include <new>
+#include <stdexcept>
+
+static const size_t chunkSize = 2 << 20;
+
+size_t RouteSlab::usedCount() const {
+  size_t n = 0;
+  for (auto word : used) {
+    n += __builtin_popcountll(word);
+  }
+  return n;
+}
+
+SlabPool &SlabPool::instance() {
+  static SlabPool pool;
+  return pool;
+}
+
+SlabPool::SlabPool()
+    : hugePages(false), chunk(nullptr), chunkFree(0), totals{0, 0, 0, 0} {}
+
+void SlabPool::setHugePages(bool enable) {
+  std::lock_guard<std::mutex> lock{mutex};
+  hugePages = enable;
+}
+
+void SlabPool::mapChunk() {
+  void *p = MAP_FAILED;
+  if (hugePages) {
+    p = mmap(nullptr, chunkSize, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED)
+      std::cerr << "Huge pages unavailable, using normal pages" << std::endl;
+    else
+      totals.hugePageBytes += chunkSize;
+  }
+  if (p == MAP_FAILED) {
+    p = mmap(nullptr, chunkSize, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      throw std::runtime_error("mmap");
+    if (hugePages)
+      madvise(p, chunkSize, MADV_HUGEPAGE);
+  }
+
+  chunk = (char *)p;
+  chunkFree = chunkSize;
+  totals.mappedBytes += chunkSize;
+
+  // Make room for every slab ever carved so that release never allocates.
+  freeSlabs.reserve(totals.mappedBytes / sizeof(RouteSlab));
+}
+
+RouteSlab *SlabPool::allocate() {
+  std::lock_guard<std::mutex> lock{mutex};
+
+  RouteSlab *slab;
+  if (!freeSlabs.empty()) {
+    slab = freeSlabs.back();
+    freeSlabs.pop_back();
+  } else {
+    if (chunkFree < sizeof(RouteSlab))
+      mapChunk();
+    slab = new (chunk) RouteSlab;
+    chunk += sizeof(RouteSlab);
+    chunkFree -= sizeof(RouteSlab);
+    totals.slabs++;
+  }
+
+  slab->refs.store(1, std::memory_order_relaxed);
+  for (auto &word : slab->used) {
+    word = 0;
+  }
+  return slab;
+}
+
+void SlabPool::release(RouteSlab *slab) {
+  std::lock_guard<std::mutex> lock{mutex};
+  freeSlabs.push_back(slab);
+}
+
+SlabPool::Stats SlabPool::stats() {
+  std::lock_guard<std::mutex> lock{mutex};
+  Stats rv = totals;
+  rv.freeSlabs = freeSlabs.size();
+  return rv;
+}
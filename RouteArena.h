@@ -0,0 +1,97 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+static const size_t routeSlabSize = 256;
+
+// Fixed-size block of route slots, stored as one dense column per field so
+// that bulk operations (see RouteKernels.h) only touch the fields they need.
+// Slabs are shared between the routing table and its snapshots and are
+// reference counted intrusively, so that sharing one never touches the
+// global allocator.
+struct RouteSlab {
+  std::atomic<int> refs;
+  uint64_t used[routeSlabSize / 64];
+  uint32_t dst[routeSlabSize]; // network byte order
+  uint32_t nextHop[routeSlabSize];
+  int32_t metric[routeSlabSize];
+  uint8_t dstLen[routeSlabSize];
+
+  bool isUsed(size_t i) const { return used[i / 64] >> (i % 64) & 1; }
+  void setUsed(size_t i, bool u) {
+    if (u)
+      used[i / 64] |= 1ULL << (i % 64);
+    else
+      used[i / 64] &= ~(1ULL << (i % 64));
+  }
+  size_t usedCount() const;
+};
+
+// Process-wide arena of route slabs. Memory is mapped in large chunks,
+// optionally backed by huge pages, and released slabs go to a free list, so
+// once the table has reached its working size new slabs never come from the
+// global allocator. Mapped memory is never returned to the system.
+class SlabPool {
+public:
+  static SlabPool &instance();
+
+  // Only affects chunks mapped afterwards.
+  void setHugePages(bool enable);
+
+  // Returns a slab with a single reference and no used slots.
+  RouteSlab *allocate();
+  void release(RouteSlab *slab);
+
+  struct Stats {
+    size_t mappedBytes;
+    size_t hugePageBytes;
+    size_t slabs;
+    size_t freeSlabs;
+  };
+  Stats stats();
+
+private:
+  SlabPool();
+  void mapChunk();
+
+  std::mutex mutex;
+  bool hugePages;
+  char *chunk;
+  size_t chunkFree;
+  std::vector<RouteSlab *> freeSlabs;
+  Stats totals;
+};
+
+// Owning handle to a reference of a slab.
+class SlabRef {
+public:
+  SlabRef() : slab(nullptr) {}
+  // Adopts the reference returned by SlabPool::allocate.
+  explicit SlabRef(RouteSlab *slab) : slab(slab) {}
+  SlabRef(const SlabRef &other) : slab(other.slab) {
+    if (slab)
+      slab->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+  SlabRef(SlabRef &&other) : slab(other.slab) { other.slab = nullptr; }
+  SlabRef &operator=(SlabRef other) {
+    std::swap(slab, other.slab);
+    return *this;
+  }
+  ~SlabRef() {
+    if (slab && slab->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      SlabPool::instance().release(slab);
+  }
+
+  RouteSlab *get() const { return slab; }
+  RouteSlab *operator->() const { return slab; }
+  bool unique() const {
+    return slab->refs.load(std::memory_order_acquire) == 1;
+  }
+
+private:
+  RouteSlab *slab;
+};
@@ -0,0 +1,142 @@
+#include "RouteKernels.h"
+
+#include <immintrin.h>
+
+#include <cstring>
+#include <string>
+
+enum class Isa { scalar, sse42, avx2 };
+
+static Isa detectIsa() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return Isa::avx2;
+  if (__builtin_cpu_supports("sse4.2"))
+    return Isa::sse42;
+  return Isa::scalar;
+}
+
+static Isa isa = detectIsa();
+
+const char *routeKernelIsa() {
+  switch (isa) {
+  case Isa::avx2:
+    return "avx2";
+  case Isa::sse42:
+    return "sse4.2";
+  default:
+    return "scalar";
+  }
+}
+
+bool setRouteKernelIsa(const char *name) {
+  std::string s{name};
+  Isa wanted;
+  if (s == "avx2")
+    wanted = Isa::avx2;
+  else if (s == "sse4.2")
+    wanted = Isa::sse42;
+  else if (s == "scalar")
+    wanted = Isa::scalar;
+  else
+    return false;
+  if (wanted > detectIsa())
+    return false;
+  isa = wanted;
+  return true;
+}
+
+static void clearMask(uint64_t *mask, size_t n) {
+  std::memset(mask, 0, (n + 63) / 64 * sizeof(uint64_t));
+}
+
+static void setBits(uint64_t *mask, size_t i, uint64_t bits) {
+  mask[i / 64] |= bits << (i % 64);
+}
+
+// Scalar versions, also used for the tails left by the vector versions.
+
+static void matchIndirectScalar(const uint32_t *indices, size_t first,
+                                size_t n, const int32_t *table, int32_t value,
+                                uint64_t *mask) {
+  for (size_t i = first; i < n; i++) {
+    if (table[indices[i]] == value)
+      setBits(mask, i, 1);
+  }
+}
+
+static void matchPrefixScalar(const uint32_t *networks, const uint32_t *masks,
+                              size_t first, size_t n, uint32_t addr,
+                              uint64_t *mask) {
+  for (size_t i = first; i < n; i++) {
+    if ((addr & masks[i]) == networks[i])
+      setBits(mask, i, 1);
+  }
+}
+
+// AVX2: 8 elements per instruction.
+
+__attribute__((target("avx2"))) static size_t
+matchIndirectAvx2(const uint32_t *indices, size_t n, const int32_t *table,
+                  int32_t value, uint64_t *mask) {
+  __m256i v = _mm256_set1_epi32(value);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i idx = _mm256_loadu_si256((const __m256i *)&indices[i]);
+    __m256i x = _mm256_i32gather_epi32((const int *)table, idx, 4);
+    __m256i eq = _mm256_cmpeq_epi32(x, v);
+    setBits(mask, i, _mm256_movemask_ps(_mm256_castsi256_ps(eq)));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static size_t
+matchPrefixAvx2(const uint32_t *networks, const uint32_t *masks, size_t n,
+                uint32_t addr, uint64_t *mask) {
+  __m256i a = _mm256_set1_epi32(addr);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i net = _mm256_loadu_si256((const __m256i *)&networks[i]);
+    __m256i m = _mm256_loadu_si256((const __m256i *)&masks[i]);
+    __m256i eq = _mm256_cmpeq_epi32(_mm256_and_si256(a, m), net);
+    setBits(mask, i, _mm256_movemask_ps(_mm256_castsi256_ps(eq)));
+  }
+  return i;
+}
+
+// SSE4.2: 4 elements per instruction. There is no gather, so matchIndirect
+// falls back to scalar code.
+
+__attribute__((target("sse4.2"))) static size_t
+matchPrefixSse42(const uint32_t *networks, const uint32_t *masks, size_t n,
+                 uint32_t addr, uint64_t *mask) {
+  __m128i a = _mm_set1_epi32(addr);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i net = _mm_loadu_si128((const __m128i *)&networks[i]);
+    __m128i m = _mm_loadu_si128((const __m128i *)&masks[i]);
+    __m128i eq = _mm_cmpeq_epi32(_mm_and_si128(a, m), net);
+    setBits(mask, i, _mm_movemask_ps(_mm_castsi128_ps(eq)));
+  }
+  return i;
+}
+
+void matchIndirect(const uint32_t *indices, size_t n, const int32_t *table,
+                   int32_t value, uint64_t *mask) {
+  clearMask(mask, n);
+  size_t i = 0;
+  if (isa == Isa::avx2)
+    i = matchIndirectAvx2(indices, n, table, value, mask);
+  matchIndirectScalar(indices, i, n, table, value, mask);
+}
+
+void matchPrefix(const uint32_t *networks, const uint32_t *masks, size_t n,
+                 uint32_t addr, uint64_t *mask) {
+  clearMask(mask, n);
+  size_t i = 0;
+  if (isa == Isa::avx2)
+    i = matchPrefixAvx2(networks, masks, n, addr, mask);
+  else if (isa == Isa::sse42)
+    i = matchPrefixSse42(networks, masks, n, addr, mask);
+  matchPrefixScalar(networks, masks, i, n, addr, mask);
+}
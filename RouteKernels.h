@@ -0,0 +1,25 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Bulk operations over the columns of a RouteSlab. Each kernel has AVX2,
+// SSE4.2 and scalar implementations, picked once at startup from the CPU's
+// capabilities. Result masks have bit i set for element i and must have room
+// for (n + 63) / 64 words; kernels overwrite them.
+
+// Returns the instruction set the kernels use ("avx2", "sse4.2", "scalar").
+const char *routeKernelIsa();
+
+// Switches the kernels to the given instruction set, for testing. Fails if
+// the CPU does not support it.
+bool setRouteKernelIsa(const char *name);
+
+// Marks elements i for which table[indices[i]] equals value. All indices must
+// be valid for table.
+void matchIndirect(const uint32_t *indices, size_t n, const int32_t *table,
+                   int32_t value, uint64_t *mask);
+
+// Marks elements i for which addr & masks[i] equals networks[i]. Networks
+// must already be masked.
+void matchPrefix(const uint32_t *networks, const uint32_t *masks, size_t n,
+                 uint32_t addr, uint64_t *mask);
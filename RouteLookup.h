@@ -0,0 +1,25 @@
+#pragma once
+#include "Entry.h"
+#include "Lpm.h"
+#include "RoutingTable.h"
+
+#include <memory>
+
+// Longest prefix match over reachable routes, with the routes it resolves
+// to, as of the end of some batch of changes. It is immutable, so any
+// number of threads may look up routes in one without locking, and a
+// caller doing many lookups can hold on to one instead of fetching the
+// latest every time.
+struct RouteLookup {
+  std::shared_ptr<const Lpm> lpm;
+  std::shared_ptr<const RoutingTableSnapshot> routes;
+
+  // Finds the longest prefix route covering addr.
+  bool lookup(in_addr addr, Entry &route) const {
+    long slot = lpm->lookup(addr);
+    if (slot < 0)
+      return false;
+    route = (*routes)[slot];
+    return true;
+  }
+};
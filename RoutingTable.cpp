@@ -0,0 +1,381 @@
+#include "RoutingTable.h"
+
+#include "RouteKernels.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+
+const uint32_t RoutingTable::noSlot;
+
+static size_t hashKey(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return key;
+}
+
+static uint64_t nextHopKey(in_addr gateway, int oif) {
+  return ((uint64_t)gateway.s_addr << 32) | (uint32_t)oif;
+}
+
+static Entry makeEntry(const RouteSlab &slab, size_t i,
+                       const NextHopGroups &groups) {
+  Entry entry{};
+  entry.dst.s_addr = slab.dst[i];
+  entry.dst_len = slab.dstLen[i];
+  const std::vector<NextHop> &group = groups[slab.nextHop[i]];
+  if (!group.empty()) {
+    entry.gateway = group[0].gateway;
+    entry.oif = group[0].oif;
+  }
+  entry.metric = slab.metric[i];
+  return entry;
+}
+
+// Returns a table with 1 for the groups containing a next hop that matches
+// and 0 for the others, for matchIndirect.
+template <typename Match>
+static std::vector<int32_t> groupsWith(const NextHopGroups &groups,
+                                       Match match) {
+  std::vector<int32_t> rv(groups.size());
+  for (size_t id = 0; id < groups.size(); id++) {
+    for (const auto &nextHop : groups[id]) {
+      rv[id] |= match(nextHop);
+    }
+  }
+  return rv;
+}
+
+RoutingTableSnapshot::RoutingTableSnapshot(
+    std::vector<SlabRef> slabs, size_t slots,
+    std::shared_ptr<const NextHopGroups> nextHopGroups)
+    : slabs(std::move(slabs)), slots(slots),
+      nextHopGroups(std::move(nextHopGroups)) {}
+
+// Appends the used entries of the slab; those marked in mask are skipped or,
+// if poison is set, appended with an infinite metric.
+void RoutingTableSnapshot::appendSlab(const RouteSlab &slab, size_t count,
+                                      const uint64_t *mask, bool poison,
+                                      std::vector<Entry> &rv) const {
+  for (size_t w = 0; w < routeSlabSize / 64; w++) {
+    uint64_t used = slab.used[w];
+    uint64_t marked = mask ? mask[w] & used : 0;
+    if (!poison)
+      used &= ~marked;
+    while (used) {
+      size_t i = w * 64 + __builtin_ctzll(used);
+      used &= used - 1;
+      if (i >= count)
+        return;
+      rv.push_back(makeEntry(slab, i, *nextHopGroups));
+      if (marked >> (i % 64) & 1)
+        rv.back().metric = infinityMetric;
+    }
+  }
+}
+
+Entry RoutingTableSnapshot::operator[](size_t slot) const {
+  return makeEntry(*slabs[slot / routeSlabSize].get(), slot % routeSlabSize,
+                   *nextHopGroups);
+}
+
+std::vector<Entry> RoutingTableSnapshot::entries() const {
+  std::vector<Entry> rv;
+  rv.reserve(slots);
+  for (size_t s = 0; s < slabs.size(); s++) {
+    appendSlab(*slabs[s].get(), slots - s * routeSlabSize, nullptr, false, rv);
+  }
+  return rv;
+}
+
+std::vector<Entry> RoutingTableSnapshot::entriesExcept(int oif,
+                                                       bool poison) const {
+  auto onOif = groupsWith(*nextHopGroups, [oif](const NextHop &nextHop) {
+    return nextHop.oif == oif;
+  });
+
+  std::vector<Entry> rv;
+  rv.reserve(slots);
+  uint64_t mask[routeSlabSize / 64];
+  for (size_t s = 0; s < slabs.size(); s++) {
+    const RouteSlab &slab = *slabs[s].get();
+    matchIndirect(slab.nextHop, routeSlabSize, onOif.data(), 1, mask);
+    appendSlab(slab, slots - s * routeSlabSize, mask, poison, rv);
+  }
+  return rv;
+}
+
+RoutingTable::RoutingTable()
+    : slotCount(0), liveCount(0), index(16),
+      nextHopGroups(std::make_shared<NextHopGroups>(1)), groupRefs(1),
+      currentGeneration(0), oldestChanged(noSlot), newestChanged(noSlot) {}
+
+Entry RoutingTable::operator[](size_t slot) const {
+  return makeEntry(slab(slot), slot % routeSlabSize, *nextHopGroups);
+}
+
+uint64_t RoutingTable::key(size_t slot) const {
+  const RouteSlab &s = slab(slot);
+  size_t i = slot % routeSlabSize;
+  return ((uint64_t)s.dst[i] << 8) | s.dstLen[i];
+}
+
+uint32_t RoutingTable::internNextHop(in_addr gateway, int oif) {
+  auto it = nextHopIds.find(nextHopKey(gateway, oif));
+  if (it != nextHopIds.end())
+    return it->second;
+
+  uint32_t id = addGroup({NextHop{gateway, oif}});
+  nextHopIds[nextHopKey(gateway, oif)] = id;
+  return id;
+}
+
+// Groups are interned in the given order, so that the primary next hop is
+// kept.
+uint32_t RoutingTable::internNextHops(const std::vector<NextHop> &nextHops) {
+  if (nextHops.size() == 1)
+    return internNextHop(nextHops[0].gateway, nextHops[0].oif);
+
+  std::vector<uint64_t> key;
+  for (const auto &nextHop : nextHops) {
+    key.push_back(nextHopKey(nextHop.gateway, nextHop.oif));
+  }
+  auto it = multipathIds.find(key);
+  if (it != multipathIds.end())
+    return it->second;
+
+  uint32_t id = addGroup(nextHops);
+  multipathIds[key] = id;
+  return id;
+}
+
+// Stores a new group, in the place of an unused one if there is any, first
+// copying the groups if a snapshot still refers to them.
+uint32_t RoutingTable::addGroup(const std::vector<NextHop> &nextHops) {
+  if (nextHopGroups.use_count() != 1)
+    nextHopGroups = std::make_shared<NextHopGroups>(*nextHopGroups);
+
+  if (freeGroups.empty()) {
+    nextHopGroups->push_back(nextHops);
+    groupRefs.push_back(0);
+    return nextHopGroups->size() - 1;
+  }
+  uint32_t id = freeGroups.back();
+  freeGroups.pop_back();
+  (*nextHopGroups)[id] = nextHops;
+  return id;
+}
+
+// Points slot i of the slab at group id, releasing the group it used before
+// if no other slot uses it. A released group keeps its contents, which
+// snapshots may still read, until its id is reused.
+void RoutingTable::setGroup(RouteSlab &slab, size_t i, uint32_t id) {
+  uint32_t old = slab.nextHop[i];
+  slab.nextHop[i] = id;
+  if (id != 0)
+    groupRefs[id]++;
+  if (old == 0 || --groupRefs[old] != 0)
+    return;
+
+  const std::vector<NextHop> &group = (*nextHopGroups)[old];
+  if (group.size() == 1) {
+    nextHopIds.erase(nextHopKey(group[0].gateway, group[0].oif));
+  } else {
+    std::vector<uint64_t> key;
+    for (const auto &nextHop : group) {
+      key.push_back(nextHopKey(nextHop.gateway, nextHop.oif));
+    }
+    multipathIds.erase(key);
+  }
+  freeGroups.push_back(old);
+}
+
+// Returns the index position holding the key, or the empty position where it
+// would be inserted.
+size_t RoutingTable::probe(uint64_t wanted) const {
+  size_t mask = index.size() - 1;
+  for (size_t pos = hashKey(wanted) & mask;; pos = (pos + 1) & mask) {
+    uint32_t slot = index[pos];
+    if (slot == 0 || key(slot - 1) == wanted)
+      return pos;
+  }
+}
+
+void RoutingTable::rehash(size_t capacity) {
+  index.assign(capacity, 0);
+  for (size_t slot = 0; slot < slotCount; slot++) {
+    if (isLive(slot))
+      index[probe(key(slot))] = slot + 1;
+  }
+}
+
+// Returns the slab for modification, first copying it if a snapshot still
+// refers to it.
+RouteSlab &RoutingTable::writableSlab(size_t s) {
+  SlabRef &slab = slabs[s];
+  if (!slab.unique()) {
+    RouteSlab *copy = SlabPool::instance().allocate();
+    std::memcpy(copy->used, slab->used, sizeof copy->used);
+    std::memcpy(copy->dst, slab->dst, sizeof copy->dst);
+    std::memcpy(copy->nextHop, slab->nextHop, sizeof copy->nextHop);
+    std::memcpy(copy->metric, slab->metric, sizeof copy->metric);
+    std::memcpy(copy->dstLen, slab->dstLen, sizeof copy->dstLen);
+    slab = SlabRef{copy};
+  }
+  cachedSnapshot = nullptr;
+  return *slab.get();
+}
+
+// Returns the slab of the slot for modification and records the slot as
+// changed.
+RouteSlab &RoutingTable::writable(size_t slot) {
+  touch(slot);
+  return writableSlab(slot / routeSlabSize);
+}
+
+// Stamps the slot with a new generation and moves it to the tail of the
+// dirty list.
+void RoutingTable::touch(size_t slot) {
+  if (slot == slotGeneration.size()) {
+    slotGeneration.push_back(0);
+    prevChanged.push_back(noSlot);
+    nextChanged.push_back(noSlot);
+  } else {
+    uint32_t prev = prevChanged[slot];
+    uint32_t next = nextChanged[slot];
+    (prev == noSlot ? oldestChanged : nextChanged[prev]) = next;
+    (next == noSlot ? newestChanged : prevChanged[next]) = prev;
+  }
+
+  slotGeneration[slot] = ++currentGeneration;
+  prevChanged[slot] = newestChanged;
+  nextChanged[slot] = noSlot;
+  (newestChanged == noSlot ? oldestChanged : nextChanged[newestChanged]) =
+      slot;
+  newestChanged = slot;
+}
+
+void RoutingTable::changesSince(uint64_t g, std::vector<size_t> &slots) const {
+  uint32_t slot = newestChanged;
+  size_t first = slots.size();
+  while (slot != noSlot && slotGeneration[slot] > g) {
+    slots.push_back(slot);
+    slot = prevChanged[slot];
+  }
+  std::reverse(slots.begin() + first, slots.end());
+}
+
+long RoutingTable::find(in_addr dst, uint8_t dst_len) const {
+  uint32_t slot = index[probe(routeKey(dst, dst_len))];
+  return (long)slot - 1;
+}
+
+size_t RoutingTable::upsert(const Entry &entry) {
+  uint32_t nextHop = internNextHop(entry.gateway, entry.oif);
+
+  size_t pos = probe(routeKey(entry));
+  if (index[pos] != 0) {
+    size_t slot = index[pos] - 1;
+    RouteSlab &slab = writable(slot);
+    setGroup(slab, slot % routeSlabSize, nextHop);
+    slab.metric[slot % routeSlabSize] = entry.metric;
+    return slot;
+  }
+
+  size_t slot;
+  if (!freeSlots.empty()) {
+    slot = freeSlots.back();
+    freeSlots.pop_back();
+  } else {
+    slot = slotCount++;
+    if (slot % routeSlabSize == 0) {
+      // Unused slots must hold a valid next hop id for the kernels.
+      RouteSlab *slab = SlabPool::instance().allocate();
+      std::memset(slab->nextHop, 0, sizeof slab->nextHop);
+      slabs.push_back(SlabRef{slab});
+    }
+  }
+
+  RouteSlab &slab = writable(slot);
+  size_t i = slot % routeSlabSize;
+  slab.dst[i] = entry.dst.s_addr;
+  slab.dstLen[i] = entry.dst_len;
+  setGroup(slab, i, nextHop);
+  slab.metric[i] = entry.metric;
+  slab.setUsed(i, true);
+  liveCount++;
+
+  index[pos] = slot + 1;
+  if (liveCount * 2 > index.size())
+    rehash(index.size() * 2);
+  return slot;
+}
+
+void RoutingTable::setNextHops(size_t slot,
+                               const std::vector<NextHop> &nextHops) {
+  if (nextHops.empty())
+    throw std::runtime_error("route without next hops");
+  uint32_t id = internNextHops(nextHops);
+  setGroup(writable(slot), slot % routeSlabSize, id);
+}
+
+void RoutingTable::remove(size_t slot) {
+  // Backward shift deletion keeps linear probing chains intact without
+  // tombstones.
+  size_t mask = index.size() - 1;
+  size_t pos = probe(key(slot));
+  index[pos] = 0;
+  for (size_t next = (pos + 1) & mask; index[next] != 0;
+       next = (next + 1) & mask) {
+    size_t ideal = hashKey(key(index[next] - 1)) & mask;
+    if (((next - ideal) & mask) >= ((next - pos) & mask)) {
+      index[pos] = index[next];
+      index[next] = 0;
+      pos = next;
+    }
+  }
+
+  RouteSlab &slab = writable(slot);
+  slab.setUsed(slot % routeSlabSize, false);
+  setGroup(slab, slot % routeSlabSize, 0);
+  freeSlots.push_back(slot);
+  liveCount--;
+}
+
+std::shared_ptr<const RoutingTableSnapshot> RoutingTable::snapshot() {
+  if (!cachedSnapshot)
+    cachedSnapshot =
+        std::make_shared<RoutingTableSnapshot>(slabs, slotCount, nextHopGroups);
+  return cachedSnapshot;
+}
+
+void RoutingTable::findByInterface(int oif,
+                                   std::vector<size_t> &slots) const {
+  auto onOif = groupsWith(*nextHopGroups, [oif](const NextHop &nextHop) {
+    return nextHop.oif == oif;
+  });
+
+  uint64_t mask[routeSlabSize / 64];
+  for (size_t s = 0; s < slabs.size(); s++) {
+    const RouteSlab &slab = *slabs[s].get();
+    matchIndirect(slab.nextHop, routeSlabSize, onOif.data(), 1, mask);
+    for (size_t w = 0; w < routeSlabSize / 64; w++) {
+      for (uint64_t bits = mask[w] & slab.used[w]; bits; bits &= bits - 1) {
+        slots.push_back(s * routeSlabSize + w * 64 + __builtin_ctzll(bits));
+      }
+    }
+  }
+}
+
+std::vector<SlabUsage> RoutingTable::slabUsage() const {
+  std::vector<SlabUsage> rv;
+  for (const auto &slab : slabs) {
+    rv.push_back(
+        SlabUsage{slab->usedCount(), sizeof(RouteSlab), !slab.unique()});
+  }
+  return rv;
+}
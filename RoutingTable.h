@@ -0,0 +1,161 @@
+#pragma once
+#include "Entry.h"
+#include "RouteArena.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Identifies a route by its full prefix, so that e.g. 10.0.0.0/8 and
+// 10.0.0.0/16 are distinct routes.
+inline uint64_t routeKey(in_addr dst, uint8_t dst_len) {
+  return ((uint64_t)dst.s_addr << 8) | dst_len;
+}
+
+inline uint64_t routeKey(const Entry &entry) {
+  return routeKey(entry.dst, entry.dst_len);
+}
+
+// Next hop groups by id.
+using NextHopGroups = std::vector<std::vector<NextHop>>;
+
+// Immutable view of the routing table at some point in time. It shares
+// slabs and next hop groups with the table and with other snapshots, and
+// may be read from any thread without locking.
+class RoutingTableSnapshot {
+public:
+  RoutingTableSnapshot(std::vector<SlabRef> slabs, size_t slots,
+                       std::shared_ptr<const NextHopGroups> nextHopGroups);
+
+  // Returns the live entries in slot order.
+  std::vector<Entry> entries() const;
+  Entry operator[](size_t slot) const;
+  // Same, but routes with a next hop on oif are left out or, if poison is
+  // set, given an infinite metric.
+  std::vector<Entry> entriesExcept(int oif, bool poison) const;
+
+private:
+  void appendSlab(const RouteSlab &slab, size_t count, const uint64_t *mask,
+                  bool poison, std::vector<Entry> &rv) const;
+
+  std::vector<SlabRef> slabs;
+  size_t slots;
+  std::shared_ptr<const NextHopGroups> nextHopGroups;
+};
+
+// Per-slab memory usage, for reporting.
+struct SlabUsage {
+  size_t liveRoutes;
+  size_t bytes;
+  bool shared;
+};
+
+// Routing table with an open-addressing (linear probing) hash index on
+// (dst, dst_len). Entries live in slots of fixed-size, column-oriented slabs
+// from SlabPool, with next hops interned into small integer ids. A route
+// has one next hop or a group of equal-cost ones; the first one is its
+// primary next hop, reported in its Entry. A slot
+// keeps its number for the lifetime of the route, replacements happen in
+// place and removed slots are reused through a free list, so inserting and
+// removing never moves other entries and iteration order does not change
+// between broadcasts.
+//
+// Slabs are shared with snapshots and copied on write, so taking a snapshot
+// costs one pointer per slab and an update costs at most one slab copy,
+// whatever the table size. The next hop groups are shared the same way and
+// only copied when a new group is interned while a snapshot holds them.
+// Groups are reference counted by the slots using them, and the id of an
+// unused one is reused for the next new group.
+class RoutingTable {
+public:
+  RoutingTable();
+
+  // Returns the slot of the route, or -1 if there is none.
+  long find(in_addr dst, uint8_t dst_len) const;
+  // Inserts the route or replaces the one with the same prefix, with the
+  // entry's gateway and oif as its only next hop. Returns its slot.
+  size_t upsert(const Entry &entry);
+  // Replaces the next hops of the route in the given live slot. The first
+  // one becomes the primary next hop.
+  void setNextHops(size_t slot, const std::vector<NextHop> &nextHops);
+  const std::vector<NextHop> &nextHops(size_t slot) const {
+    return (*nextHopGroups)[slab(slot).nextHop[slot % routeSlabSize]];
+  }
+  // Removes the route in the given live slot.
+  void remove(size_t slot);
+
+  size_t size() const { return liveCount; }
+  // Upper bound of slot numbers, for iterating with isLive.
+  size_t slots() const { return slotCount; }
+  bool isLive(size_t slot) const {
+    return slab(slot).isUsed(slot % routeSlabSize);
+  }
+  Entry operator[](size_t slot) const;
+  int metric(size_t slot) const {
+    return slab(slot).metric[slot % routeSlabSize];
+  }
+
+  // Appends the live slots with a next hop on oif.
+  void findByInterface(int oif, std::vector<size_t> &slots) const;
+
+  // Returns a snapshot of the current contents. It is only rebuilt if the
+  // table was modified since the previous call.
+  std::shared_ptr<const RoutingTableSnapshot> snapshot();
+
+  // Incremented on every modification. Consumers (advertiser, kernel
+  // installer, ...) remember the generation they last processed and ask for
+  // the changes since then.
+  uint64_t generation() const { return currentGeneration; }
+  // Appends the slots modified (including removed) after generation g,
+  // oldest change first, in time proportional to the number of such slots.
+  void changesSince(uint64_t g, std::vector<size_t> &slots) const;
+
+  std::vector<SlabUsage> slabUsage() const;
+
+private:
+  static const uint32_t noSlot = UINT32_MAX;
+
+  const RouteSlab &slab(size_t slot) const {
+    return *slabs[slot / routeSlabSize].get();
+  }
+  uint64_t key(size_t slot) const;
+  uint32_t internNextHop(in_addr gateway, int oif);
+  uint32_t internNextHops(const std::vector<NextHop> &nextHops);
+  uint32_t addGroup(const std::vector<NextHop> &nextHops);
+  void setGroup(RouteSlab &slab, size_t i, uint32_t id);
+  RouteSlab &writableSlab(size_t s);
+  RouteSlab &writable(size_t slot);
+  void touch(size_t slot);
+  size_t probe(uint64_t wanted) const;
+  void rehash(size_t capacity);
+
+  std::vector<SlabRef> slabs;
+  size_t slotCount;
+  size_t liveCount;
+  std::vector<uint32_t> freeSlots;
+  // Slot + 1 of the entry hashed to each position, 0 if empty.
+  std::vector<uint32_t> index;
+
+  // Interned next hop groups. Id 0 is the empty group of unused slots.
+  std::shared_ptr<NextHopGroups> nextHopGroups;
+  // Slots using each group (not counted for id 0). Ids of groups no slot
+  // uses are in freeGroups.
+  std::vector<uint32_t> groupRefs;
+  std::vector<uint32_t> freeGroups;
+  std::unordered_map<uint64_t, uint32_t> nextHopIds;
+  std::map<std::vector<uint64_t>, uint32_t> multipathIds;
+
+  std::shared_ptr<const RoutingTableSnapshot> cachedSnapshot;
+
+  // Dirty set: every slot is on a doubly linked list ordered by the
+  // generation of its last modification, most recent at the tail.
+  uint64_t currentGeneration;
+  std::vector<uint64_t> slotGeneration;
+  std::vector<uint32_t> prevChanged;
+  std::vector<uint32_t> nextChanged;
+  uint32_t oldestChanged;
+  uint32_t newestChanged;
+};
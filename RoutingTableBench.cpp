@@ -0,0 +1,365 @@
+#include "Lpm.h"
+#include "RouteAggregator.h"
+#include "RouteKernels.h"
+#include "RouteLookup.h"
+#include "RoutingTable.h"
+#include "utils.h"
+
+#include <arpa/inet.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Applies a full neighbor dump of n routes to an empty table (lookup,
+// insert and LPM update, as after startup) and to a table already holding
+// them, the way Service::handleReceivedEntry does (lookup, then replace),
+// and reports the time per route for each. It should stay flat as n grows.
+// Then measures
+// longest-prefix-match lookups of random addresses over the same routes,
+// and a full-table scan for the routes through one interface.
+
+static std::vector<Entry> makeDump(size_t n, int metric) {
+  std::vector<Entry> dump(n);
+  for (size_t i = 0; i < n; i++) {
+    dump[i].dst.s_addr = htonl(0x0a000000 + (i << 8));
+    dump[i].dst_len = 24;
+    dump[i].metric = metric;
+  }
+  return dump;
+}
+
+// Checks Lpm against a linear scan over random inserts and removals, with
+// prefixes of every length, and that a snapshot does not see later changes.
+static bool checkLpm() {
+  std::mt19937 rng{2};
+
+  // Longest live prefix shorter than maxLen covering addrh.
+  using Routes = std::vector<std::pair<uint32_t, uint8_t>>;
+  auto longestMatch = [](const Routes &routes, uint32_t addrh,
+                         int maxLen = 33) {
+    long best = -1;
+    for (size_t id = 0; id < routes.size(); id++) {
+      uint8_t len = routes[id].second;
+      uint32_t mask = len == 0 ? 0 : ~0u << (32 - len);
+      if (routes[id].first != UINT32_MAX && len < maxLen &&
+          (addrh & mask) == routes[id].first &&
+          (best < 0 || len > routes[best].second))
+        best = id;
+    }
+    return best;
+  };
+
+  Routes routes;
+  Lpm lpm;
+  std::shared_ptr<const Lpm> snapshot;
+  Routes snapshotRoutes;
+  for (int round = 0; round < 2000; round++) {
+    // Addresses are drawn from a small range so that prefixes overlap.
+    uint8_t len = rng() % 33;
+    uint32_t mask = len == 0 ? 0 : ~0u << (32 - len);
+    uint32_t dsth = (0x0a000000 | (rng() & 0x3ffff)) & mask;
+    long id = -1;
+    for (size_t i = 0; i < routes.size(); i++) {
+      if (routes[i] == std::make_pair(dsth, len))
+        id = i;
+    }
+
+    if (id < 0) {
+      routes.emplace_back(dsth, len);
+      lpm.insert(in_addr{htonl(dsth)}, len, routes.size() - 1);
+    } else {
+      routes[id].first = UINT32_MAX;
+      long parent = longestMatch(routes, dsth, len);
+      lpm.remove(in_addr{htonl(dsth)}, len, parent,
+                 parent < 0 ? 0 : routes[parent].second);
+    }
+
+    if (round == 1000) {
+      snapshot = lpm.snapshot();
+      snapshotRoutes = routes;
+    }
+  }
+
+  for (int i = 0; i < 100000; i++) {
+    uint32_t addrh = 0x0a000000 | (rng() & 0x3ffff);
+    if (rng() % 8 == 0)
+      addrh = rng();
+    in_addr addr{htonl(addrh)};
+    if (lpm.lookup(addr) != longestMatch(routes, addrh) ||
+        snapshot->lookup(addr) != longestMatch(snapshotRoutes, addrh))
+      return false;
+  }
+  return true;
+}
+
+// Checks every kernel, with each instruction set the CPU supports, against
+// a plain loop, for lengths that leave tails of every size.
+static bool checkKernels() {
+  std::mt19937 rng{3};
+  std::string detected = routeKernelIsa();
+  bool ok = true;
+  for (const char *name : {"scalar", "sse4.2", "avx2"}) {
+    if (!setRouteKernelIsa(name))
+      continue;
+    for (size_t n = 0; n <= 300 && ok; n++) {
+      std::vector<int32_t> table(16);
+      for (auto &v : table)
+        v = rng() % 4;
+      std::vector<uint32_t> indices(n), networks(n), masks(n);
+      for (size_t i = 0; i < n; i++) {
+        indices[i] = rng() % table.size();
+        uint8_t len = rng() % 33;
+        masks[i] = len == 0 ? 0 : ~0u << (32 - len);
+        networks[i] = (0x0a000000 | (rng() & 0xff)) & masks[i];
+      }
+      uint32_t addr = 0x0a000000 | (rng() & 0xff);
+
+      std::vector<uint64_t> indirect((n + 63) / 64), prefix((n + 63) / 64);
+      matchIndirect(indices.data(), n, table.data(), 1, indirect.data());
+      matchPrefix(networks.data(), masks.data(), n, addr, prefix.data());
+      for (size_t i = 0; i < n; i++) {
+        bool bit = indirect[i / 64] >> (i % 64) & 1;
+        if (bit != (table[indices[i]] == 1))
+          ok = false;
+        bit = prefix[i / 64] >> (i % 64) & 1;
+        if (bit != ((addr & masks[i]) == networks[i]))
+          ok = false;
+      }
+      if (!ok)
+        std::cerr << name << " kernels disagree with a plain loop at n = " << n
+                  << std::endl;
+    }
+  }
+  setRouteKernelIsa(detected.c_str());
+  return ok;
+}
+
+// Advertised routes as neighbors see them: prefix (addr << 8 | len), in
+// host byte order, to metric and interfaces.
+using Advertised = std::map<uint64_t, std::pair<int, std::vector<int>>>;
+
+static Advertised advertised(RouteAggregator &aggregator) {
+  auto snapshot = aggregator.snapshot();
+  Advertised rv;
+  for (const auto &entry : snapshot->entries()) {
+    rv[(uint64_t)ntohl(entry.dst.s_addr) << 8 | entry.dst_len].first =
+        entry.metric;
+  }
+  // Interfaces show as the routes left out by split horizon.
+  for (int oif = 1; oif <= 3; oif++) {
+    auto except = snapshot->entriesExcept(oif, false);
+    std::set<uint64_t> kept;
+    for (const auto &entry : except) {
+      kept.insert((uint64_t)ntohl(entry.dst.s_addr) << 8 | entry.dst_len);
+    }
+    for (auto &route : rv) {
+      if (kept.count(route.first) == 0)
+        route.second.second.push_back(oif);
+    }
+  }
+  return rv;
+}
+
+// Checks RouteAggregator over random updates and removals: the advertised
+// set must match one built from scratch from the same routes, a full dump
+// followed by the deltas must rebuild it, and with autoSummarize alone,
+// the longest match of every address must have the same metric and
+// interfaces as in the routing table.
+static bool checkAggregator(const std::vector<Prefix> &summaries) {
+  std::mt19937 rng{4};
+  RouteAggregator aggregator{summaries, true};
+  Advertised routes;
+  Advertised neighbor;
+
+  // Longest match of addrh in routes, or the end.
+  auto longestMatch = [](const Advertised &routes, uint32_t addrh) {
+    for (int len = 32; len >= 0; len--) {
+      auto it = routes.find((uint64_t)(addrh & prefixMask(len)) << 8 | len);
+      if (it != routes.end())
+        return it;
+    }
+    return routes.end();
+  };
+
+  for (int round = 0; round < 3000; round++) {
+    // Prefixes are drawn from a small range so that they aggregate.
+    uint8_t len = 20 + rng() % 5;
+    uint32_t dsth = (0x0a000000 | (rng() & 0xfff) << 8) & prefixMask(len);
+    in_addr dst{htonl(dsth)};
+    uint64_t key = (uint64_t)dsth << 8 | len;
+    if (rng() % 3 == 0) {
+      aggregator.remove(dst, len);
+      routes.erase(key);
+    } else {
+      int metric = 1 + rng() % 2;
+      std::vector<int> oifs;
+      for (int oif = 1; oif <= 3; oif++) {
+        if (rng() % 2 || (oif == 3 && oifs.empty()))
+          oifs.push_back(oif);
+      }
+      aggregator.update(dst, len, metric, oifs);
+      routes[key] = {metric, oifs};
+    }
+
+    if (round % 10 == 0) {
+      std::vector<Entry> entries;
+      std::map<size_t, std::vector<int>> multipathOifs;
+      aggregator.takeChanges(entries, multipathOifs);
+      for (const auto &entry : entries) {
+        uint64_t k = (uint64_t)ntohl(entry.dst.s_addr) << 8 | entry.dst_len;
+        if (entry.metric == infinityMetric)
+          neighbor.erase(k);
+        else
+          neighbor[k].first = entry.metric;
+      }
+      Advertised current = advertised(aggregator);
+      for (auto &route : neighbor) {
+        if (current.count(route.first))
+          route.second.second = current[route.first].second;
+      }
+      if (neighbor != current) {
+        std::cerr << "Aggregated deltas do not rebuild the advertised routes"
+                  << std::endl;
+        return false;
+      }
+    }
+
+    if (round % 100 == 0) {
+      RouteAggregator rebuilt{summaries, true};
+      for (const auto &route : routes) {
+        rebuilt.update(in_addr{htonl(route.first >> 8)}, route.first & 0xff,
+                       route.second.first, route.second.second);
+      }
+      Advertised current = advertised(aggregator);
+      if (advertised(rebuilt) != current) {
+        std::cerr << "Aggregated routes differ from ones built from scratch"
+                  << std::endl;
+        return false;
+      }
+
+      for (int i = 0; i < 1000 && summaries.empty(); i++) {
+        uint32_t addrh = 0x0a000000 | (rng() & 0xfffff);
+        auto want = longestMatch(routes, addrh);
+        auto got = longestMatch(current, addrh);
+        if ((want == routes.end()) != (got == current.end()) ||
+            (want != routes.end() && want->second != got->second)) {
+          std::cerr << "Aggregation changed the route to "
+                    << to_string(in_addr{htonl(addrh)}) << std::endl;
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+int main() {
+  if (!checkLpm()) {
+    std::cerr << "Lpm disagrees with a linear scan" << std::endl;
+    return 1;
+  }
+  if (!checkKernels())
+    return 1;
+  if (!checkAggregator({}) ||
+      !checkAggregator({Prefix{in_addr{htonl(0x0a000000)}, 21}}))
+    return 1;
+
+  for (size_t n : {1000, 10000, 100000, 1000000}) {
+    RoutingTable table;
+    Lpm lpm;
+    auto initial = makeDump(n, 5);
+    auto start = std::chrono::steady_clock::now();
+    for (const auto &entry : initial) {
+      if (table.find(entry.dst, entry.dst_len) < 0)
+        lpm.insert(entry.dst, entry.dst_len, table.upsert(entry));
+    }
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    std::cout << n << " routes into empty table: " << elapsed.count() / 1e6
+              << " ms, " << elapsed.count() / n << " ns/route" << std::endl;
+
+    auto dump = makeDump(n, 3);
+    start = std::chrono::steady_clock::now();
+    for (const auto &entry : dump) {
+      long slot = table.find(entry.dst, entry.dst_len);
+      if (slot < 0 || entry.metric < table[slot].metric)
+        table.upsert(entry);
+    }
+    elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << n << " routes replaced: " << elapsed.count() / 1e6 << " ms, "
+              << elapsed.count() / n << " ns/route" << std::endl;
+
+    const size_t lookups = 10000000;
+    std::mt19937 rng{1};
+    std::vector<in_addr> addrs(1 << 16);
+    for (auto &addr : addrs) {
+      addr.s_addr = htonl(0x0a000000 + rng() % (n << 8));
+    }
+
+    long found = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < lookups; i++) {
+      found += lpm.lookup(addrs[i & (addrs.size() - 1)]) >= 0;
+    }
+    elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << n << " routes: " << lookups / (elapsed.count() / 1e9) / 1e6
+              << " M lookups/s (" << found << " hits)" << std::endl;
+
+    // The same through RouteLookup from several threads, fetching the
+    // published routes for every lookup like Service::lookupRoute, and
+    // keeping them for all lookups.
+    std::shared_ptr<const RouteLookup> published =
+        std::make_shared<RouteLookup>(
+            RouteLookup{lpm.snapshot(), table.snapshot()});
+    const size_t threads = 4;
+    for (bool fetchEach : {true, false}) {
+      std::atomic<long> hits{0};
+      std::vector<std::thread> workers;
+      start = std::chrono::steady_clock::now();
+      for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+          auto routes = std::atomic_load(&published);
+          long found = 0;
+          Entry route;
+          for (size_t i = t; i < lookups; i += threads) {
+            if (fetchEach)
+              routes = std::atomic_load(&published);
+            found += routes->lookup(addrs[i & (addrs.size() - 1)], route);
+          }
+          hits += found;
+        });
+      }
+      for (auto &worker : workers) {
+        worker.join();
+      }
+      elapsed = std::chrono::steady_clock::now() - start;
+
+      std::cout << n << " routes: "
+                << lookups / (elapsed.count() / 1e9) / 1e6
+                << " M lookups/s over " << threads << " threads, "
+                << (fetchEach ? "fetching the routes every time"
+                              : "with one fetch")
+                << " (" << hits << " hits)" << std::endl;
+    }
+
+    std::vector<size_t> slots;
+    start = std::chrono::steady_clock::now();
+    table.findByInterface(dump[0].oif, slots);
+    elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << n << " routes: interface scan in " << elapsed.count() / 1e3
+              << " us (" << routeKernelIsa() << ", " << slots.size()
+              << " matches)" << std::endl;
+  }
+}
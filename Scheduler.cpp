@@ -0,0 +1,160 @@
+#include "Scheduler.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+PeriodicSchedule::PeriodicSchedule(std::chrono::milliseconds interval,
+                                   std::chrono::milliseconds jitter)
+    : interval(interval), jitter(std::min(jitter, interval / 2)),
+      base(std::chrono::steady_clock::now()), next(base),
+      rng(std::random_device{}()) {}
+
+std::chrono::steady_clock::time_point PeriodicSchedule::deadline() const {
+  return next;
+}
+
+void PeriodicSchedule::advance(std::chrono::steady_clock::time_point now) {
+  base += interval;
+  if (base <= now)
+    base = now + interval;
+
+  std::uniform_int_distribution<long> offset(-jitter.count(), jitter.count());
+  next = base + std::chrono::milliseconds{offset(rng)};
+}
+
+static const std::chrono::microseconds minSendBackoff{100};
+static const std::chrono::microseconds maxSendBackoff{10000};
+
+// Sends all datagrams with as few sendmmsg calls as the kernel allows,
+// resuming after partial sends. Each datagram carries IP_PKTINFO pinning it
+// to its interface. Returns the number of syscalls made.
+static int sendDatagrams(int sfd, const std::vector<Datagram *> &datagrams) {
+  std::vector<iovec> iovs(datagrams.size());
+  std::vector<mmsghdr> msgs(datagrams.size());
+  std::vector<PktinfoControl> controls(datagrams.size());
+  for (size_t i = 0; i < datagrams.size(); i++) {
+    iovs[i].iov_base = datagrams[i]->payload.data();
+    iovs[i].iov_len = datagrams[i]->payload.size();
+
+    msghdr &hdr = msgs[i].msg_hdr;
+    hdr = msghdr{};
+    hdr.msg_name = &datagrams[i]->addr;
+    hdr.msg_namelen = sizeof datagrams[i]->addr;
+    hdr.msg_iov = &iovs[i];
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = controls[i].buf;
+    hdr.msg_controllen = sizeof controls[i].buf;
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = IPPROTO_IP;
+    cmsg->cmsg_type = IP_PKTINFO;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(in_pktinfo));
+    in_pktinfo pktinfo{};
+    pktinfo.ipi_ifindex = datagrams[i]->oif;
+    std::memcpy(CMSG_DATA(cmsg), &pktinfo, sizeof pktinfo);
+  }
+
+  int syscalls = 0;
+  size_t sent = 0;
+  auto backoff = minSendBackoff;
+  while (sent < msgs.size()) {
+    int n = sendmmsg(sfd, &msgs[sent], msgs.size() - sent, 0);
+    syscalls++;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      // The socket buffer is full: wait until it drains.
+      if (errno == EAGAIN) {
+        pollfd pfd{sfd, POLLOUT, 0};
+        poll(&pfd, 1, maxSendBackoff.count() / 1000);
+        continue;
+      }
+      // The interface queue is full, which POLLOUT does not tell: back off.
+      if (errno == ENOBUFS) {
+        std::this_thread::sleep_for(backoff);
+        backoff = std::min(backoff * 2, maxSendBackoff);
+        continue;
+      }
+      // The first pending datagram failed, e.g. its interface is gone.
+      std::cerr << "sendmmsg: " << std::strerror(errno) << " (dev "
+                << datagrams[sent]->oif << ")" << std::endl;
+      n = 1;
+    }
+    sent += n;
+    backoff = minSendBackoff;
+  }
+  return syscalls;
+}
+
+PacedSender::PacedSender(int sfd, double packetsPerSecond, int burst)
+    : sfd(sfd), packetsPerSecond(packetsPerSecond),
+      burst(std::max(burst, 1)) {}
+
+PacedSender::Stats PacedSender::send(std::vector<Datagram> &datagrams) {
+  auto start = std::chrono::steady_clock::now();
+  Stats stats{0, std::chrono::microseconds{0}};
+
+  if (packetsPerSecond <= 0) {
+    std::vector<Datagram *> all;
+    for (auto &datagram : datagrams) {
+      all.push_back(&datagram);
+    }
+    stats.syscalls = sendDatagrams(sfd, all);
+    stats.duration = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+    return stats;
+  }
+
+  std::map<int, std::vector<Datagram *>> queues;
+  for (auto &datagram : datagrams) {
+    queues[datagram.oif].push_back(&datagram);
+  }
+  std::map<int, size_t> positions;
+
+  size_t remaining = datagrams.size();
+  while (remaining > 0) {
+    auto now = std::chrono::steady_clock::now();
+
+    std::vector<Datagram *> batch;
+    for (auto &queue : queues) {
+      size_t &pos = positions[queue.first];
+      if (pos == queue.second.size())
+        continue;
+
+      auto it = buckets.find(queue.first);
+      if (it == buckets.end())
+        it = buckets.emplace(queue.first, Bucket{(double)burst, now}).first;
+      Bucket &bucket = it->second;
+
+      std::chrono::duration<double> elapsed = now - bucket.updated;
+      bucket.tokens = std::min<double>(
+          burst, bucket.tokens + elapsed.count() * packetsPerSecond);
+      bucket.updated = now;
+
+      size_t n = std::min<size_t>(bucket.tokens, queue.second.size() - pos);
+      bucket.tokens -= n;
+      batch.insert(batch.end(), queue.second.begin() + pos,
+                   queue.second.begin() + pos + n);
+      pos += n;
+    }
+
+    if (batch.empty()) {
+      std::this_thread::sleep_for(
+          std::chrono::duration<double>(1 / packetsPerSecond));
+      continue;
+    }
+
+    stats.syscalls += sendDatagrams(sfd, batch);
+    remaining -= batch.size();
+  }
+
+  stats.duration = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  return stats;
+}
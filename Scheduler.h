@@ -0,0 +1,65 @@
+#pragma once
+#include <netinet/ip.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <vector>
+
+struct Datagram {
+  int oif;
+  sockaddr_in addr;
+  std::vector<uint8_t> payload;
+};
+
+// Room for an IP_PKTINFO control message, aligned for cmsghdr, as used both
+// to send datagrams from an interface and to learn which one they arrived on.
+union PktinfoControl {
+  char buf[CMSG_SPACE(sizeof(in_pktinfo))];
+  cmsghdr align;
+};
+
+// Periodic deadlines on the monotonic clock. Deadlines advance by exactly one
+// interval from the previous one, so slow broadcasts do not make the period
+// drift, and each one is offset by a random jitter so that routers booted
+// together do not stay synchronized.
+class PeriodicSchedule {
+public:
+  PeriodicSchedule(std::chrono::milliseconds interval,
+                   std::chrono::milliseconds jitter);
+  std::chrono::steady_clock::time_point deadline() const;
+  void advance(std::chrono::steady_clock::time_point now);
+
+private:
+  std::chrono::milliseconds interval;
+  std::chrono::milliseconds jitter;
+  std::chrono::steady_clock::time_point base;
+  std::chrono::steady_clock::time_point next;
+  std::mt19937 rng;
+};
+
+// Sends datagrams with sendmmsg, limiting each interface to packetsPerSecond
+// with a token bucket of depth burst. A rate of 0 disables the limit.
+class PacedSender {
+public:
+  PacedSender(int sfd, double packetsPerSecond, int burst);
+
+  struct Stats {
+    int syscalls;
+    std::chrono::microseconds duration;
+  };
+  Stats send(std::vector<Datagram> &datagrams);
+
+private:
+  struct Bucket {
+    double tokens;
+    std::chrono::steady_clock::time_point updated;
+  };
+
+  int sfd;
+  double packetsPerSecond;
+  int burst;
+  std::map<int, Bucket> buckets;
+};
@@ -1,5 +1,6 @@
 #include "Service.h"
 
+#include "Codec.h"
 #include "NetlinkRouteSocket.h"
 #include "utils.h"
 
@@ -9,6 +10,7 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <cerrno>
 #include <chrono>
 #include <cstring>
 #include <iostream>
@@ -22,8 +24,16 @@ using namespace std::chrono_literals;
 
 static const int port = 1234;
 
+static const auto fullDumpRequestInterval = 5s;
+
+static const auto routeTimerTick = 1s;
+
 Service::Service(std::vector<EnabledInterface> enabledInterfaces,
-                 std::vector<Entry> directRoutes) {
+                 std::vector<Entry> directRoutes, ServiceOptions options)
+    : aggregator{options.summaries, options.autoSummarize},
+      routeTimers{routeTimerTick, std::chrono::steady_clock::now()} {
+  SlabPool::instance().setHugePages(options.hugePages);
+
   if ((sfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
     throw std::runtime_error("socket [UDP]");
   }
@@ -39,129 +49,1079 @@ Service::Service(std::vector<EnabledInterface> enabledInterfaces,
   si_me.sin_port = htons(port);
   si_me.sin_addr.s_addr = htonl(INADDR_ANY);
 
+  int pktinfoEnable = 1;
+  if (setsockopt(sfd, IPPROTO_IP, IP_PKTINFO, &pktinfoEnable,
+                 sizeof pktinfoEnable) != 0) {
+    throw std::runtime_error("setsockopt");
+  }
+
   if (bind(sfd, (sockaddr *)&si_me, sizeof si_me) == -1) {
     throw std::runtime_error("bind");
   }
 
+  if (options.transport == Transport::multicast) {
+    joinMulticastGroup(enabledInterfaces, options.multicastGroup);
+  }
+
   this->enabledInterfaces = enabledInterfaces;
-  this->routingTable = directRoutes;
+  for (size_t i = 0; i < enabledInterfaces.size(); i++) {
+    this->interfaceByIndex[enabledInterfaces[i].oif] = i;
+    this->interfaceIndex.add(enabledInterfaces[i].addr,
+                             enabledInterfaces[i].addr_len,
+                             enabledInterfaces[i].oif);
+  }
+  for (const auto &route : directRoutes) {
+    replaceEntry(route);
+  }
+  this->directRoutes = directRoutes;
+  this->options = options;
+  this->options.recvBatchSize = std::max<size_t>(options.recvBatchSize, 1);
+  this->options.maxPaths = std::max<size_t>(options.maxPaths, 1);
+  this->options.fullDumpEvery = std::max(options.fullDumpEvery, 1);
+  loadKernelRoutes();
+  publishRoutes();
 
   this->recvThread = std::thread{[=]() { recvLoop(); }};
   this->broadcastThread = std::thread{[=]() { broadcastLoop(); }};
+  this->eventThread = std::thread{[=]() { eventLoop(); }};
+}
+
+// Joins the group on every enabled interface. Outgoing datagrams are pinned
+// to their interface with IP_PKTINFO; IP_MULTICAST_IF only sets the default.
+// Loopback is disabled so that our own updates are not received back.
+void Service::joinMulticastGroup(
+    const std::vector<EnabledInterface> &enabledInterfaces, in_addr group) {
+  for (const auto &iface : enabledInterfaces) {
+    ip_mreqn mreq{};
+    mreq.imr_multiaddr = group;
+    mreq.imr_ifindex = iface.oif;
+    if (setsockopt(sfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof mreq) !=
+        0) {
+      throw std::runtime_error("setsockopt [IP_ADD_MEMBERSHIP]");
+    }
+  }
+
+  if (!enabledInterfaces.empty()) {
+    ip_mreqn mreq{};
+    mreq.imr_ifindex = enabledInterfaces[0].oif;
+    if (setsockopt(sfd, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof mreq) !=
+        0) {
+      throw std::runtime_error("setsockopt [IP_MULTICAST_IF]");
+    }
+  }
+
+  unsigned char loop = 0;
+  if (setsockopt(sfd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof loop) !=
+      0) {
+    throw std::runtime_error("setsockopt [IP_MULTICAST_LOOP]");
+  }
+
+  unsigned char ttl = 1;
+  if (setsockopt(sfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof ttl) != 0) {
+    throw std::runtime_error("setsockopt [IP_MULTICAST_TTL]");
+  }
+}
+
+static const size_t maxDatagramSize = 65536;
+
+// Returns the enabled interface the datagram arrived on, as reported by
+// IP_PKTINFO, or -1 if it arrived on an interface that is not enabled.
+int Service::findIngressInterface(msghdr &hdr, in_addr sender) {
+  for (cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+    if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+      in_pktinfo pktinfo;
+      std::memcpy(&pktinfo, CMSG_DATA(cmsg), sizeof pktinfo);
+      auto it = interfaceByIndex.find(pktinfo.ipi_ifindex);
+      return it == interfaceByIndex.end() ? -1 : it->first;
+    }
+  }
+  return findInterfaceByIp(sender);
 }
 
 void Service::recvLoop() {
+  size_t batchSize = options.recvBatchSize;
+
+  std::vector<uint8_t> buf(batchSize * maxDatagramSize);
+  std::vector<sockaddr_in> senders(batchSize);
+  std::vector<iovec> iovs(batchSize);
+  std::vector<mmsghdr> msgs(batchSize);
+  std::vector<PktinfoControl> controls(batchSize);
+
+  std::vector<Entry> packetEntries(maxDecodedEntries(maxDatagramSize));
+  std::vector<Entry> batchEntries;
+
   while (true) {
-    struct sockaddr_in sender {};
-    Entry entry;
+    for (size_t i = 0; i < batchSize; i++) {
+      iovs[i].iov_base = &buf[i * maxDatagramSize];
+      iovs[i].iov_len = maxDatagramSize;
 
-    socklen_t sendsize = sizeof sender;
+      msghdr &hdr = msgs[i].msg_hdr;
+      hdr = msghdr{};
+      hdr.msg_name = &senders[i];
+      hdr.msg_namelen = sizeof senders[i];
+      hdr.msg_iov = &iovs[i];
+      hdr.msg_iovlen = 1;
+      hdr.msg_control = controls[i].buf;
+      hdr.msg_controllen = sizeof controls[i].buf;
+    }
 
-    int len = recvfrom(sfd, &entry, sizeof entry, 0, (struct sockaddr *)&sender,
-                       &sendsize);
-    if (len != sizeof entry) {
-      throw std::runtime_error("recvfrom");
+    int n = recvmmsg(sfd, msgs.data(), batchSize, MSG_WAITFORONE, nullptr);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      throw std::runtime_error("recvmmsg");
     }
 
-    entry.gateway = sender.sin_addr;
-    entry.oif = findInterfaceByIp(sender.sin_addr);
-    entry.metric++;
+    auto start = std::chrono::steady_clock::now();
+
+    batchEntries.clear();
+    bool dumpRequested = false;
+    for (int i = 0; i < n; i++) {
+      const sockaddr_in &sender = senders[i];
+
+      PacketHeader header;
+      int count =
+          decodePacket((uint8_t *)iovs[i].iov_base, msgs[i].msg_len, header,
+                       packetEntries.data(), packetEntries.size());
+      if (count < 0) {
+        std::cerr << "Malformed packet from " << to_string(sender.sin_addr)
+                  << std::endl;
+        continue;
+      }
+
+      int oif = findIngressInterface(msgs[i].msg_hdr, sender.sin_addr);
+      if (oif < 0) {
+        std::cerr << "Packet from " << to_string(sender.sin_addr)
+                  << " on a disabled interface" << std::endl;
+        continue;
+      }
 
-    handleReceivedEntry(entry);
+      if (header.type == packetRequest) {
+        dumpRequested = true;
+        continue;
+      }
+
+      if (!checkSequence(sender.sin_addr, header))
+        requestFullDump(sender.sin_addr);
+
+      for (int j = 0; j < count; j++) {
+        Entry &entry = packetEntries[j];
+        entry.gateway = sender.sin_addr;
+        entry.oif = oif;
+        entry.metric = std::min(entry.metric + 1, infinityMetric);
+        batchEntries.push_back(entry);
+      }
+    }
+
+    size_t changed = handleReceivedEntries(batchEntries, dumpRequested);
+
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    std::cerr << "Drained batch: " << n << " datagrams, "
+              << batchEntries.size() << " entries, " << changed
+              << " route changes in "
+              << std::chrono::duration_cast<std::chrono::microseconds>(elapsed)
+                     .count()
+              << " us" << std::endl;
   }
 }
 
-void Service::handleReceivedEntry(Entry entry) {
+// Tracks the fragments of the neighbor's current full dump or delta. Returns
+// false if a packet was lost, in which case the neighbor's deltas can no
+// longer be trusted to be complete until its next full dump.
+bool Service::checkSequence(in_addr neighbor, const PacketHeader &header) {
+  NeighborState &state = neighbors[neighbor.s_addr];
+
+  bool inOrder;
+  if (header.fragment == 0)
+    inOrder = header.type == packetFull ||
+              (state.synced && header.baseSeq == state.seq);
+  else
+    inOrder = state.assembling && header.seq == state.pendingSeq &&
+              header.fragment == state.nextFragment;
+
+  if (!inOrder) {
+    state.synced = false;
+    state.assembling = false;
+    return false;
+  }
+
+  state.assembling = true;
+  state.pendingSeq = header.seq;
+  state.nextFragment = header.fragment + 1;
+  if (state.nextFragment == header.fragments) {
+    state.assembling = false;
+    state.synced = true;
+    state.seq = header.seq;
+  }
+  return true;
+}
+
+void Service::requestFullDump(in_addr neighbor) {
+  NeighborState &state = neighbors[neighbor.s_addr];
+  auto now = std::chrono::steady_clock::now();
+  if (now - state.lastRequest < fullDumpRequestInterval)
+    return;
+  state.lastRequest = now;
+
+  std::cerr << "Sequence gap, requesting full dump from "
+            << to_string(neighbor) << std::endl;
+
+  PacketHeader header{packetRequest, 0, 0, 0, 1};
+  uint8_t buf[wireHeaderSize];
+  size_t len;
+  encodePacket(header, nullptr, 0, buf, sizeof buf, len);
+
+  struct sockaddr_in addr {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr = neighbor;
+
+  // A lost request is recovered by the next gap or periodic full dump.
+  if (sendto(sfd, buf, len, 0, (struct sockaddr *)&addr, sizeof addr) < 0)
+    std::cerr << "Cannot request full dump from " << to_string(neighbor)
+              << ": " << std::strerror(errno) << std::endl;
+}
+
+// Returns the number of entries that changed a route. Nothing is logged per
+// entry, as that would flush stderr for every route of a dump while the
+// mutex is held.
+size_t Service::handleReceivedEntries(const std::vector<Entry> &entries,
+                                      bool fullDumpRequested) {
   std::lock_guard<std::mutex> lock{mutex};
+  bool timersIdle = routeTimers.size() == 0;
+  size_t changed = 0;
+  for (const auto &entry : entries) {
+    if (isInterfaceUp(entry.oif))
+      changed += handleReceivedEntry(entry);
+  }
+  flushRouteChanges();
+  publishRoutes();
+  if (fullDumpRequested)
+    this->fullDumpRequested = true;
+  // The broadcast loop only wakes up for route timers while there are any.
+  if (hasUnadvertisedChanges() || this->fullDumpRequested ||
+      (timersIdle && routeTimers.size() > 0))
+    broadcastCv.notify_one();
+  return changed;
+}
 
-  std::cerr << "Received entry: " << to_string(entry.dst) << "/"
-            << (int)entry.dst_len << " via " << to_string(entry.gateway);
+// Routes are replaced by strictly better ones, and neighbors advertising the
+// same metric are added as equal-cost next hops, up to maxPaths. Updates
+// from a current next hop are always taken and refresh its timeout. If it
+// advertises an infinite metric, or a worse one than the other next hops,
+// it stops being a next hop. Returns whether the route changed.
+bool Service::handleReceivedEntry(Entry entry) {
+  long slot = routingTable.find(entry.dst, entry.dst_len);
+  int oldMetric = findMetric(entry.dst, entry.dst_len);
 
-  int oldMetric = findMetricByDst(entry.dst);
+  // Not used after removePath or replaceEntry, which may reallocate it.
+  static const std::vector<NextHop> noPaths;
+  const std::vector<NextHop> &paths =
+      slot >= 0 ? routingTable.nextHops(slot) : noPaths;
+  size_t path = 0;
+  while (path < paths.size() && !(paths[path].gateway == entry.gateway &&
+                                  paths[path].oif == entry.oif))
+    path++;
+  bool fromNextHop = path < paths.size();
+
+  if (fromNextHop && (entry.metric >= infinityMetric ||
+                      (entry.metric > oldMetric && paths.size() > 1))) {
+    if (paths.size() > 1)
+      removePath(slot, path);
+    else if (oldMetric < infinityMetric)
+      timeoutRoute(slot);
+    else
+      return false;
+    return true;
+  }
 
-  std::cerr << " [old metric: " << oldMetric << " new metric: " << entry.metric
-            << "]" << std::endl;
+  if (fromNextHop && entry.metric == oldMetric) {
+    heardTime(slot, path) = std::chrono::steady_clock::now();
+    scheduleTimeout(slot);
+    return false;
+  }
+
+  bool better = entry.metric < oldMetric && entry.metric < infinityMetric;
+  if (fromNextHop || better) {
+    replaceEntry(entry);
+    fibChanges.push_back(RouteChange{false, entry, {}});
+    slot = routingTable.find(entry.dst, entry.dst_len);
+    heardTime(slot, 0) = std::chrono::steady_clock::now();
+    scheduleTimeout(slot);
+    return true;
+  }
 
-  if (entry.metric < oldMetric) {
-    replaceEntry(entry.dst, entry);
-    NetlinkRouteSocket nls;
-    nls.setRoute(entry);
+  if (entry.metric == oldMetric && entry.metric < infinityMetric &&
+      routeTimers.isScheduled(slot) && paths.size() < options.maxPaths) {
+    addPath(slot, NextHop{entry.gateway, entry.oif});
+    return true;
   }
+  return false;
 }
 
-static bool isInSubnet(struct in_addr addr, struct in_addr net,
-                       uint8_t net_len) {
-  uint32_t addrh = ntohl(addr.s_addr);
-  uint32_t neth = ntohl(net.s_addr);
-  uint32_t mask = ~((1 << (32 - net_len)) - 1);
-  bool rv = (addrh & mask) == (neth & mask);
-  return rv;
+// Follows the kernel's notifications: routes through an interface that goes
+// down or loses its address are withdrawn at once, rather than when they
+// time out, and routes of the daemon deleted from the kernel by someone else
+// are put back.
+void Service::eventLoop() {
+  std::vector<NetlinkEvent> events;
+  while (true) {
+    events.clear();
+    bool complete = kernelEvents.receive(events);
+
+    std::lock_guard<std::mutex> lock{mutex};
+    bool timersIdle = routeTimers.size() == 0;
+    for (const auto &event : events) {
+      handleKernelEvent(event);
+    }
+    if (!complete)
+      reinstallRoutes();
+    flushRouteChanges();
+    publishRoutes();
+    if (hasUnadvertisedChanges() || fullDumpRequested ||
+        (timersIdle && routeTimers.size() > 0))
+      broadcastCv.notify_one();
+  }
 }
 
-int Service::findInterfaceByIp(struct in_addr addr) {
-  for (auto iface : enabledInterfaces) {
-    if (isInSubnet(addr, iface.addr, iface.addr_len)) {
-      return iface.oif;
+void Service::handleKernelEvent(const NetlinkEvent &event) {
+  if (event.type == NetlinkEventType::newRoute ||
+      event.type == NetlinkEventType::deleteRoute) {
+    const RtMessage &route = event.route;
+    if (reconciling && event.type == NetlinkEventType::deleteRoute &&
+        route.protocol == ownRouteProtocol)
+      forgetKernelRoute(route);
+    long slot = routingTable.find(route.dst, route.dst_len);
+    // Direct routes are not ours to install, and routes timed out are
+    // withdrawn on purpose.
+    if (slot < 0 || !routeTimers.isScheduled(slot) ||
+        routingTable.metric(slot) >= infinityMetric)
+      return;
+    if (event.type == NetlinkEventType::deleteRoute &&
+        route.protocol == ownRouteProtocol) {
+      std::cerr << "Route " << to_string(route.dst) << "/"
+                << (int)route.dst_len
+                << " deleted from the kernel, reinstalling" << std::endl;
+      installRoute(slot);
+    } else if (event.type == NetlinkEventType::newRoute &&
+               route.protocol != ownRouteProtocol) {
+      std::cerr << "Route " << to_string(route.dst) << "/"
+                << (int)route.dst_len << " replaced in the kernel (protocol "
+                << (int)route.protocol << ")" << std::endl;
     }
+    return;
+  }
+
+  auto it = interfaceByIndex.find(event.oif);
+  if (it == interfaceByIndex.end())
+    return;
+  const EnabledInterface &iface = enabledInterfaces[it->second];
+  InterfaceState &state = interfaceStates[event.oif];
+  bool wasUp = state.linkUp && state.hasAddress;
+
+  switch (event.type) {
+  case NetlinkEventType::linkUp:
+  case NetlinkEventType::linkDown:
+    state.linkUp = event.type == NetlinkEventType::linkUp;
+    break;
+  case NetlinkEventType::newAddress:
+  case NetlinkEventType::deleteAddress: {
+    uint32_t mask = prefixMask(iface.addr_len);
+    if (event.addr_len != iface.addr_len ||
+        (ntohl(event.addr.s_addr) & mask) != (ntohl(iface.addr.s_addr) & mask))
+      return;
+    state.hasAddress = event.type == NetlinkEventType::newAddress;
+    break;
   }
-  throw std::runtime_error("no such interface");
+  default:
+    return;
+  }
+
+  bool isUp = state.linkUp && state.hasAddress;
+  if (wasUp && !isUp)
+    interfaceDown(event.oif);
+  else if (!wasUp && isUp)
+    interfaceUp(event.oif);
 }
 
+bool Service::isInterfaceUp(int oif) const {
+  auto it = interfaceStates.find(oif);
+  return it == interfaceStates.end() ||
+         (it->second.linkUp && it->second.hasAddress);
+}
+
+// Makes direct routes on the interface unreachable and drops its next hops
+// from learned routes, timing out those left without any.
+void Service::interfaceDown(int oif) {
+  std::vector<size_t> slots;
+  routingTable.findByInterface(oif, slots);
+  std::cerr << "Interface " << oif << " is down, withdrawing " << slots.size()
+            << " routes" << std::endl;
+
+  for (size_t slot : slots) {
+    if (routingTable.metric(slot) >= infinityMetric)
+      continue;
+    if (!routeTimers.isScheduled(slot)) {
+      Entry entry = routingTable[slot];
+      entry.metric = infinityMetric;
+      replaceEntry(entry);
+      continue;
+    }
+
+    std::vector<NextHop> paths = routingTable.nextHops(slot);
+    for (size_t path = paths.size(); path-- > 0 && paths.size() > 1;) {
+      if (paths[path].oif == oif) {
+        removePath(slot, path);
+        paths.erase(paths.begin() + path);
+      }
+    }
+    if (paths.size() == 1 && paths[0].oif == oif)
+      timeoutRoute(slot);
+  }
+}
+
+// Restores the direct routes on the interface, replacing routes learned in
+// the meantime, and advertises the whole table to the neighbors there.
+void Service::interfaceUp(int oif) {
+  std::cerr << "Interface " << oif << " is up" << std::endl;
+
+  for (const auto &route : directRoutes) {
+    if (route.oif != oif)
+      continue;
+    long slot = routingTable.find(route.dst, route.dst_len);
+    if (slot >= 0 && routeTimers.isScheduled(slot)) {
+      if (routingTable.metric(slot) < infinityMetric)
+        fibChanges.push_back(RouteChange{true, routingTable[slot], {}});
+      routeTimers.cancel(slot);
+    }
+    replaceEntry(route);
+  }
+  fullDumpRequested = true;
+}
+
+// Installs every learned route again after kernel notifications were lost,
+// since any of them may have been deleted.
+void Service::reinstallRoutes() {
+  std::cerr << "Kernel notifications lost, reinstalling learned routes"
+            << std::endl;
+  for (size_t slot = 0; slot < routingTable.slots(); slot++) {
+    if (routingTable.isLive(slot) && routeTimers.isScheduled(slot) &&
+        routingTable.metric(slot) < infinityMetric)
+      installRoute(slot);
+  }
+}
+
+static uint64_t prefixOrder(in_addr dst, uint8_t dst_len) {
+  return (uint64_t)ntohl(dst.s_addr) << 8 | dst_len;
+}
+
+static bool operator==(const NextHop &a, const NextHop &b) {
+  return a.gateway == b.gateway && a.oif == b.oif;
+}
+
+static std::vector<NextHop> sortedNextHops(std::vector<NextHop> nextHops) {
+  std::sort(nextHops.begin(), nextHops.end(),
+            [](const NextHop &a, const NextHop &b) {
+              return std::make_pair(a.gateway.s_addr, a.oif) <
+                     std::make_pair(b.gateway.s_addr, b.oif);
+            });
+  return nextHops;
+}
+
+static std::vector<NextHop> kernelNextHops(const RtMessage &route) {
+  if (route.nextHops.empty())
+    return {NextHop{route.gateway, route.oif}};
+  return route.nextHops;
+}
+
+// Reads the routes a previous run of the daemon left in the kernel. They
+// keep forwarding until reconcileDeadline, by when neighbors have advertised
+// their routes again.
+void Service::loadKernelRoutes() {
+  NetlinkRouteSocket netlink;
+  for (const auto &route : netlink.getRoutes()) {
+    if (route.table == RT_TABLE_MAIN && route.protocol == ownRouteProtocol &&
+        route.type == RTN_UNICAST)
+      kernelRoutes.push_back(route);
+  }
+  if (kernelRoutes.empty())
+    return;
+
+  std::sort(kernelRoutes.begin(), kernelRoutes.end(),
+            [](const RtMessage &a, const RtMessage &b) {
+              return prefixOrder(a.dst, a.dst_len) <
+                     prefixOrder(b.dst, b.dst_len);
+            });
+  reconciling = true;
+  reconcileDeadline = std::chrono::steady_clock::now() + options.reconcileDelay;
+  std::cerr << "Found " << kernelRoutes.size()
+            << " routes of a previous run in the kernel" << std::endl;
+}
+
+// Returns the first of the routes, sorted by prefix, with the given prefix
+// or a later one.
+static std::vector<RtMessage>::const_iterator
+firstKernelRoute(const std::vector<RtMessage> &routes, uint64_t key) {
+  return std::lower_bound(routes.begin(), routes.end(), key,
+                          [](const RtMessage &a, uint64_t key) {
+                            return prefixOrder(a.dst, a.dst_len) < key;
+                          });
+}
+
+bool Service::isKernelRoute(in_addr dst, uint8_t dst_len) const {
+  uint64_t key = prefixOrder(dst, dst_len);
+  auto it = firstKernelRoute(kernelRoutes, key);
+  return it != kernelRoutes.end() && prefixOrder(it->dst, it->dst_len) == key;
+}
+
+void Service::forgetKernelRoute(const RtMessage &route) {
+  uint64_t key = prefixOrder(route.dst, route.dst_len);
+  for (auto it = firstKernelRoute(kernelRoutes, key);
+       it != kernelRoutes.end() && prefixOrder(it->dst, it->dst_len) == key;
+       ++it) {
+    if (sortedNextHops(kernelNextHops(*it)) ==
+        sortedNextHops(kernelNextHops(route))) {
+      kernelRoutes.erase(it);
+      return;
+    }
+  }
+}
+
+// Deletes exactly the given one of the routes for its prefix.
+static RouteChange staleRouteChange(const RtMessage &route) {
+  NextHop nextHop = kernelNextHops(route)[0];
+  Entry entry{route.dst, route.dst_len, nextHop.gateway, nextHop.oif,
+              route.metric};
+  return RouteChange{true, entry, {}, route.tos, route.priority};
+}
+
+// Merges the learned routes and the kernel's routes, both sorted by prefix,
+// and only writes the differences: routes with other next hops are
+// replaced, and those no longer in the table deleted. Routes missing from
+// the kernel were added as they were learned.
+//
+// Of several routes for a prefix, installing replaces the one with no TOS
+// and priority and the others are deleted. The deletes name each route
+// exactly and are written first, bypassing fibWriter, which would coalesce
+// them with each other and with the install.
+void Service::reconcileKernelRoutes() {
+  std::vector<std::pair<uint64_t, size_t>> learned;
+  for (size_t slot = 0; slot < routingTable.slots(); slot++) {
+    if (routingTable.isLive(slot) && routeTimers.isScheduled(slot) &&
+        routingTable.metric(slot) < infinityMetric) {
+      Entry entry = routingTable[slot];
+      learned.emplace_back(prefixOrder(entry.dst, entry.dst_len), slot);
+    }
+  }
+  std::sort(learned.begin(), learned.end());
+
+  reconciling = false;
+  size_t kept = 0, added = 0, replaced = 0;
+  std::vector<RouteChange> stale;
+  size_t i = 0, j = 0;
+  while (i < learned.size() || j < kernelRoutes.size()) {
+    uint64_t wanted = i < learned.size() ? learned[i].first : UINT64_MAX;
+    uint64_t present =
+        j < kernelRoutes.size()
+            ? prefixOrder(kernelRoutes[j].dst, kernelRoutes[j].dst_len)
+            : UINT64_MAX;
+
+    if (present < wanted) {
+      stale.push_back(staleRouteChange(kernelRoutes[j++]));
+      continue;
+    }
+
+    size_t slot = learned[i++].second;
+    if (wanted < present) {
+      added++;
+      continue;
+    }
+
+    const RtMessage *current = nullptr;
+    for (; j < kernelRoutes.size() &&
+           prefixOrder(kernelRoutes[j].dst, kernelRoutes[j].dst_len) == wanted;
+         j++) {
+      const RtMessage &route = kernelRoutes[j];
+      if (!current && route.tos == 0 && route.priority == 0)
+        current = &route;
+      else
+        stale.push_back(staleRouteChange(route));
+    }
+    if (!current) {
+      installRoute(slot);
+      added++;
+    } else if (sortedNextHops(routingTable.nextHops(slot)) ==
+               sortedNextHops(kernelNextHops(*current))) {
+      kept++;
+    } else {
+      installRoute(slot);
+      replaced++;
+    }
+  }
+
+  size_t deleted = 0;
+  if (!stale.empty()) {
+    std::vector<int> errors;
+    try {
+      NetlinkRouteSocket netlink;
+      errors = netlink.applyRoutes(stale);
+    } catch (const std::runtime_error &e) {
+      std::cerr << "Cannot delete stale kernel routes: " << e.what()
+                << std::endl;
+      errors.assign(stale.size(), EIO);
+    }
+    for (size_t k = 0; k < stale.size(); k++) {
+      if (errors[k] == 0) {
+        deleted++;
+        continue;
+      }
+      const Entry &entry = stale[k].entry;
+      std::cerr << "Cannot delete stale route " << to_string(entry.dst) << "/"
+                << (int)entry.dst_len << " (priority " << stale[k].priority
+                << "): " << std::strerror(errors[k]) << std::endl;
+    }
+  }
+
+  std::cerr << "Reconciled kernel routes: " << kept << " kept, " << added
+            << " added, " << replaced << " replaced, " << deleted
+            << " deleted, " << stale.size() - deleted << " not deleted"
+            << std::endl;
+  kernelRoutes.clear();
+  kernelRoutes.shrink_to_fit();
+  flushRouteChanges();
+}
+
+int Service::findInterfaceByIp(struct in_addr addr) {
+  return interfaceIndex.find(addr);
+}
+
+// Every broadcast interval (with jitter) sends a delta with the changes since
+// the last advertised table version, and a full dump every fullDumpEvery
+// intervals. Changes not advertised yet and full dumps requested by
+// neighbors are sent in between, at most once per suppression window, so
+// that a burst of changes is coalesced into a single send. Full dumps are
+// read from a snapshot of the table (or of the aggregated routes), so the
+// mutex is only held while the advertisement is prepared, never while it is
+// encoded and sent.
 void Service::broadcastLoop() {
+  PeriodicSchedule schedule{options.broadcastInterval, options.broadcastJitter};
+  PacedSender sender{sfd, options.maxPacketsPerSecond, options.packetBurst};
+
+  std::unique_lock<std::mutex> lock{mutex};
+
+  auto nextTriggered = std::chrono::steady_clock::now();
+  int intervals = 0;
+
   while (true) {
-    broadcastRoutingTable();
-    std::this_thread::sleep_for(30s);
+    auto now = std::chrono::steady_clock::now();
+    expireRoutes(now);
+    if (reconciling && now >= reconcileDeadline)
+      reconcileKernelRoutes();
+    bool triggered = hasUnadvertisedChanges() || fullDumpRequested;
+
+    Advertisement advertisement;
+    bool send = false;
+    if (now >= schedule.deadline()) {
+      if (intervals++ % options.fullDumpEvery == 0 || fullDumpRequested)
+        advertisement = prepareFullDump();
+      else
+        advertisement = prepareDelta();
+      schedule.advance(now);
+      send = true;
+    } else if (triggered && now >= nextTriggered) {
+      if (fullDumpRequested)
+        advertisement = prepareFullDump();
+      else
+        advertisement = prepareDelta();
+      nextTriggered = now + options.triggeredUpdateSuppression;
+      send = true;
+    }
+
+    if (send) {
+      lock.unlock();
+      auto datagrams = encodeAdvertisement(advertisement);
+      auto stats = sender.send(datagrams);
+      std::cerr << "Sent " << datagrams.size() << " datagrams on "
+                << enabledInterfaces.size() << " interfaces in "
+                << stats.syscalls << " sendmmsg calls over "
+                << stats.duration.count() << " us" << std::endl;
+      lock.lock();
+      continue;
+    }
+
+    auto deadline = schedule.deadline();
+    if (triggered)
+      deadline = std::min(deadline, nextTriggered);
+    if (routeTimers.size() > 0)
+      deadline = std::min(deadline, routeTimers.nextTick());
+    if (reconciling)
+      deadline = std::min(deadline, reconcileDeadline);
+    broadcastCv.wait_until(lock, deadline);
   }
 }
 
 static in_addr broadcastAddress(in_addr net, uint8_t net_len) {
   uint32_t neth = ntohl(net.s_addr);
-  uint32_t mask = (1 << (32 - net_len)) - 1;
-  uint32_t rvh = neth | mask;
+  uint32_t rvh = neth | ~prefixMask(net_len);
   return in_addr{htonl(rvh)};
 }
 
-void Service::broadcastRoute(Entry entry) {
-  std::cerr << "Broadcasting route..." << std::endl;
+// Filters out (simple split horizon) or poisons (poisoned reverse) routes
+// learned through the interface they are about to be advertised on. Full
+// dumps do the same with RoutingTableSnapshot::entriesExcept.
+static std::vector<Entry>
+applySplitHorizon(const std::vector<Entry> &entries,
+                  const std::map<size_t, std::vector<int>> &multipathOifs,
+                  int oif, bool poison) {
+  std::vector<Entry> rv;
+  rv.reserve(entries.size());
+  for (size_t i = 0; i < entries.size(); i++) {
+    const Entry &entry = entries[i];
+    bool learnedOnOif = entry.oif == oif;
+    auto it = multipathOifs.find(i);
+    if (it != multipathOifs.end())
+      learnedOnOif = std::find(it->second.begin(), it->second.end(), oif) !=
+                     it->second.end();
+    if (!learnedOnOif) {
+      rv.push_back(entry);
+    } else if (poison) {
+      rv.push_back(entry);
+      rv.back().metric = infinityMetric;
+    }
+  }
+  return rv;
+}
+
+std::vector<Datagram>
+Service::encodeAdvertisement(const Advertisement &advertisement) {
+  const PacketHeader &header = advertisement.header;
+  bool splitHorizon = options.splitHorizon != SplitHorizon::none;
+  bool poison = options.splitHorizon == SplitHorizon::poisonedReverse;
+
+  std::vector<Entry> allEntries;
+  if (advertisement.snapshot && !splitHorizon)
+    allEntries = advertisement.snapshot->entries();
+  allEntries.insert(allEntries.end(), advertisement.entries.begin(),
+                    advertisement.entries.end());
 
-  for (auto iface : enabledInterfaces) {
+  std::vector<Datagram> datagrams;
+  std::vector<Entry> filtered;
+
+  for (const auto &iface : enabledInterfaces) {
     struct sockaddr_in addr {};
     addr.sin_family = AF_INET;
     addr.sin_port = htons(port);
-    addr.sin_addr = broadcastAddress(iface.addr, iface.addr_len);
+    if (options.transport == Transport::multicast)
+      addr.sin_addr = options.multicastGroup;
+    else
+      addr.sin_addr = broadcastAddress(iface.addr, iface.addr_len);
+
+    const std::vector<Entry> *ifaceEntries = &allEntries;
+    if (splitHorizon) {
+      filtered.clear();
+      if (advertisement.snapshot)
+        filtered = advertisement.snapshot->entriesExcept(iface.oif, poison);
+      auto rest = applySplitHorizon(advertisement.entries,
+                                    advertisement.multipathOifs, iface.oif,
+                                    poison);
+      filtered.insert(filtered.end(), rest.begin(), rest.end());
+      ifaceEntries = &filtered;
+    }
+    const std::vector<Entry> &entries = *ifaceEntries;
 
-    if (sendto(sfd, &entry, sizeof entry, 0, (struct sockaddr *)&addr,
-               sizeof addr) < 0)
-      throw std::runtime_error("sendto");
+    size_t first = datagrams.size();
+    size_t payloadSize = iface.mtu - ipUdpHeaderSize;
+    size_t i = 0;
+    do {
+      Datagram datagram{iface.oif, addr, std::vector<uint8_t>(payloadSize)};
+      size_t len;
+      size_t count =
+          encodePacket(header, entries.data() + i, entries.size() - i,
+                       datagram.payload.data(), payloadSize, len);
+      if (len == 0 || (count == 0 && i < entries.size()))
+        throw std::runtime_error("mtu too small");
+      datagram.payload.resize(len);
+      datagrams.push_back(std::move(datagram));
+      i += count;
+    } while (i < entries.size());
+
+    size_t fragments = datagrams.size() - first;
+    if (fragments > UINT16_MAX)
+      throw std::runtime_error("too many fragments");
+    for (size_t f = 0; f < fragments; f++) {
+      setPacketFragment(datagrams[first + f].payload.data(), f, fragments);
+    }
   }
+
+  return datagrams;
 }
 
-void Service::broadcastRoutingTable() {
-  std::lock_guard<std::mutex> lock{mutex};
-  std::cerr << "Broadcasting routing table..." << std::endl;
-  for (auto entry : routingTable) {
-    broadcastRoute(entry);
+Advertisement Service::prepareFullDump() {
+  uint64_t version = routingTable.generation();
+  std::cerr << "Broadcasting routing table (version " << version << ")..."
+            << std::endl;
+
+  Advertisement rv;
+  rv.header = PacketHeader{packetFull, 0, (uint32_t)version};
+  if (aggregator.enabled()) {
+    rv.snapshot = aggregator.snapshot();
+    aggregator.clearChanges(rv.entries);
+    std::cerr << "Advertising " << aggregator.size()
+              << " aggregated routes for " << routingTable.size() << " routes"
+              << std::endl;
+  } else {
+    rv.snapshot = routingTable.snapshot();
   }
+  advertisedVersion = version;
+
+  auto usage = routingTable.slabUsage();
+  auto pool = SlabPool::instance().stats();
+  std::cerr << "Routing table memory: " << routingTable.size() << " routes in "
+            << usage.size() << " slabs, " << pool.mappedBytes
+            << " bytes mapped (" << pool.hugePageBytes << " on huge pages), "
+            << pool.freeSlabs << " free slabs" << std::endl;
+  auto fib = fibWriter.stats();
+  std::cerr << "Kernel routes: " << fib.depth << " changes pending (oldest "
+            << fib.oldestPending.count() << " us), last batch applied "
+            << fib.lastBatchLag.count() << " us after submission, "
+            << fib.written << " written, " << fib.failed << " failed, "
+            << fib.coalesced << " coalesced" << std::endl;
+  fullDumpRequested = false;
+  return rv;
+}
+
+Advertisement Service::prepareDelta() {
+  uint64_t version = routingTable.generation();
+  std::cerr << "Broadcasting delta (versions " << advertisedVersion << ".."
+            << version << ")..." << std::endl;
+
+  Advertisement rv;
+  rv.header = PacketHeader{packetDelta, (uint32_t)advertisedVersion,
+                           (uint32_t)version};
+
+  if (aggregator.enabled()) {
+    aggregator.takeChanges(rv.entries, rv.multipathOifs);
+    advertisedVersion = version;
+    return rv;
+  }
+
+  std::vector<size_t> slots;
+  routingTable.changesSince(advertisedVersion, slots);
+  for (size_t slot : slots) {
+    if (!routingTable.isLive(slot))
+      continue;
+    const std::vector<NextHop> &paths = routingTable.nextHops(slot);
+    if (paths.size() > 1) {
+      std::vector<int> &oifs = rv.multipathOifs[rv.entries.size()];
+      for (const auto &path : paths) {
+        oifs.push_back(path.oif);
+      }
+    }
+    rv.entries.push_back(routingTable[slot]);
+  }
+  advertisedVersion = version;
+  return rv;
 }
 
 void Service::join() {
   recvThread.join();
   broadcastThread.join();
+  eventThread.join();
+}
+
+bool Service::hasUnadvertisedChanges() const {
+  if (aggregator.enabled())
+    return aggregator.hasChanges();
+  return routingTable.generation() != advertisedVersion;
+}
+
+int Service::findMetric(in_addr dst, uint8_t dst_len) {
+  long slot = routingTable.find(dst, dst_len);
+  if (slot < 0)
+    return std::numeric_limits<int>::max();
+  return routingTable[slot].metric;
+}
+
+void Service::replaceEntry(Entry newEntry) {
+  long old = routingTable.find(newEntry.dst, newEntry.dst_len);
+  bool wasReachable = old >= 0 && routingTable.metric(old) < infinityMetric;
+  bool reachable = newEntry.metric < infinityMetric;
+  size_t slot = routingTable.upsert(newEntry);
+  if (reachable && !wasReachable)
+    lpm.insert(newEntry.dst, newEntry.dst_len, slot);
+  else if (!reachable && wasReachable)
+    removeFromLpm(newEntry.dst, newEntry.dst_len);
+  aggregateRoute(slot);
+}
+
+// Addresses the route covered fall back to the longest shorter prefix that
+// is still reachable.
+void Service::removeFromLpm(in_addr dst, uint8_t dst_len) {
+  long parent = -1;
+  uint8_t parentLen = 0;
+  for (int len = dst_len - 1; len >= 0 && parent < 0; len--) {
+    in_addr parentDst{htonl(ntohl(dst.s_addr) & prefixMask(len))};
+    parent = routingTable.find(parentDst, len);
+    if (parent >= 0 && routingTable.metric(parent) >= infinityMetric)
+      parent = -1;
+    parentLen = len;
+  }
+  lpm.remove(dst, dst_len, parent, parentLen);
+}
+
+// Makes the changes of the last batch visible to lookupRoute.
+void Service::publishRoutes() {
+  uint64_t version = routingTable.generation();
+  if (publishedRoutes && version == publishedVersion)
+    return;
+  auto published = std::make_shared<RouteLookup>(
+      RouteLookup{lpm.snapshot(), routingTable.snapshot()});
+  std::atomic_store(&publishedRoutes,
+                    std::shared_ptr<const RouteLookup>{std::move(published)});
+  publishedVersion = version;
+}
+
+void Service::aggregateRoute(size_t slot) {
+  if (!aggregator.enabled())
+    return;
+  Entry entry = routingTable[slot];
+  std::vector<int> oifs;
+  for (const auto &path : routingTable.nextHops(slot)) {
+    oifs.push_back(path.oif);
+  }
+  std::sort(oifs.begin(), oifs.end());
+  oifs.erase(std::unique(oifs.begin(), oifs.end()), oifs.end());
+  aggregator.update(entry.dst, entry.dst_len, entry.metric, oifs);
+}
+
+void Service::installRoute(size_t slot) {
+  fibChanges.push_back(
+      RouteChange{false, routingTable[slot], routingTable.nextHops(slot)});
 }
 
-int Service::findMetricByDst(in_addr dst) {
-  for (auto entry : routingTable) {
-    if (entry.dst == dst)
-      return entry.metric;
+// Applies the kernel route changes queued while handling received entries
+// or expired timers in one netlink batch. Until the kernel is reconciled,
+// changes of prefixes a previous run left in the kernel are dropped, as
+// reconciliation writes their final state; other prefixes have nothing to
+// wait for.
+void Service::flushRouteChanges() {
+  if (reconciling) {
+    fibChanges.erase(std::remove_if(fibChanges.begin(), fibChanges.end(),
+                                    [this](const RouteChange &change) {
+                                      return isKernelRoute(
+                                          change.entry.dst,
+                                          change.entry.dst_len);
+                                    }),
+                     fibChanges.end());
   }
-  return std::numeric_limits<int>::max();
+  fibWriter.submit(fibChanges);
+  fibChanges.clear();
+}
+
+void Service::addPath(size_t slot, NextHop nextHop) {
+  std::vector<NextHop> paths = routingTable.nextHops(slot);
+  paths.push_back(nextHop);
+  routingTable.setNextHops(slot, paths);
+  aggregateRoute(slot);
+  heardTime(slot, paths.size() - 1) = std::chrono::steady_clock::now();
+  installRoute(slot);
+}
+
+void Service::removePath(size_t slot, size_t path) {
+  std::vector<NextHop> paths = routingTable.nextHops(slot);
+  paths.erase(paths.begin() + path);
+  for (size_t i = path; i < paths.size(); i++) {
+    heardTime(slot, i) = heardTime(slot, i + 1);
+  }
+  routingTable.setNextHops(slot, paths);
+  aggregateRoute(slot);
+  installRoute(slot);
+  scheduleTimeout(slot);
+}
+
+std::chrono::steady_clock::time_point &Service::heardTime(size_t slot,
+                                                          size_t path) {
+  size_t i = slot * options.maxPaths + path;
+  if (i >= pathHeard.size())
+    pathHeard.resize(std::max(i + 1, pathHeard.size() * 2));
+  return pathHeard[i];
+}
+
+// Arms the route's timer for when its least recently heard next hop times
+// out.
+void Service::scheduleTimeout(size_t slot) {
+  size_t paths = routingTable.nextHops(slot).size();
+  auto heard = heardTime(slot, 0);
+  for (size_t path = 1; path < paths; path++) {
+    heard = std::min(heard, heardTime(slot, path));
+  }
+  routeTimers.schedule(slot, heard + options.routeTimeout);
+}
+
+// Drops the next hops that timed out from routes that have others left, and
+// times out or garbage collects the other expired routes.
+void Service::expireRoutes(std::chrono::steady_clock::time_point now) {
+  std::vector<uint32_t> expired;
+  routeTimers.advance(now, expired);
+  size_t timedOut = 0, collected = 0;
+  for (uint32_t slot : expired) {
+    if (!routingTable.isLive(slot))
+      continue;
+    if (routingTable.metric(slot) >= infinityMetric) {
+      deleteRoute(slot);
+      collected++;
+      continue;
+    }
+
+    size_t paths = routingTable.nextHops(slot).size();
+    for (size_t path = paths; path-- > 0 && paths > 1;) {
+      if (heardTime(slot, path) + options.routeTimeout <= now) {
+        removePath(slot, path);
+        paths--;
+      }
+    }
+    if (paths == 1 && heardTime(slot, 0) + options.routeTimeout <= now) {
+      timeoutRoute(slot);
+      timedOut++;
+    } else {
+      scheduleTimeout(slot);
+    }
+  }
+  flushRouteChanges();
+  publishRoutes();
+  if (timedOut > 0 || collected > 0)
+    std::cerr << "Expired routes: " << timedOut << " timed out, " << collected
+              << " garbage collected" << std::endl;
+}
+
+// Withdraws the route from the kernel and advertises it as unreachable until
+// it is garbage collected.
+void Service::timeoutRoute(size_t slot) {
+  Entry entry = routingTable[slot];
+  fibChanges.push_back(RouteChange{true, entry, {}});
+
+  entry.metric = infinityMetric;
+  replaceEntry(entry);
+  routeTimers.schedule(slot, std::chrono::steady_clock::now() +
+                                 options.garbageCollectionTimeout);
+}
+
+// Removes the route from the table.
+void Service::deleteRoute(size_t slot) {
+  Entry entry = routingTable[slot];
+  if (entry.metric < infinityMetric)
+    removeFromLpm(entry.dst, entry.dst_len);
+  routingTable.remove(slot);
+  if (aggregator.enabled())
+    aggregator.remove(entry.dst, entry.dst_len);
+  routeTimers.cancel(slot);
+}
+
+std::shared_ptr<const RouteLookup> Service::routeLookup() const {
+  return std::atomic_load(&publishedRoutes);
 }
 
-void Service::replaceEntry(in_addr dst, Entry newEntry) {
-  auto &r = routingTable;
-  auto it =
-      std::find_if(r.begin(), r.end(), [=](Entry e) { return e.dst == dst; });
-  if (it != r.end())
-    it = r.erase(it);
-  r.insert(it, newEntry);
+bool Service::lookupRoute(in_addr addr, Entry &route) const {
+  return routeLookup()->lookup(addr, route);
 }
@@ -1,41 +1,203 @@
 #pragma once
+#include "Codec.h"
 #include "Entry.h"
+#include "FibWriter.h"
+#include "InterfaceIndex.h"
+#include "Lpm.h"
+#include "RouteAggregator.h"
+#include "RouteLookup.h"
+#include "RoutingTable.h"
+#include "Scheduler.h"
+#include "TimingWheel.h"
 
 #include <netinet/ip.h>
 
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
+// IPv4 and UDP headers in front of every datagram.
+static const size_t ipUdpHeaderSize = 20 + 8;
+// Interfaces must fit a packet with at least one entry, within the IPv4
+// total length.
+static const int minInterfaceMtu =
+    ipUdpHeaderSize + wireHeaderSize + wireMaxEntrySize;
+static const int maxInterfaceMtu = 65535;
+
 struct EnabledInterface {
   in_addr addr;
   uint8_t addr_len;
   int oif;
+  int mtu;
+};
+
+enum class SplitHorizon {
+  none,
+  simple,
+  poisonedReverse,
+};
+
+enum class Transport {
+  broadcast,
+  multicast,
+};
+
+struct ServiceOptions {
+  size_t recvBatchSize = 64;
+  std::chrono::milliseconds triggeredUpdateSuppression{1000};
+  int fullDumpEvery = 10;
+  SplitHorizon splitHorizon = SplitHorizon::poisonedReverse;
+  std::chrono::milliseconds broadcastInterval{30000};
+  std::chrono::milliseconds broadcastJitter{5000};
+  double maxPacketsPerSecond = 1000;
+  int packetBurst = 64;
+  Transport transport = Transport::broadcast;
+  in_addr multicastGroup{htonl(0xe0000009)}; // 224.0.0.9
+  bool hugePages = false;
+  // A learned route not refreshed by its next hop for routeTimeout is
+  // withdrawn and advertised as unreachable, then deleted after another
+  // garbageCollectionTimeout.
+  std::chrono::milliseconds routeTimeout{180000};
+  std::chrono::milliseconds garbageCollectionTimeout{120000};
+  // Maximum number of equal-cost next hops per route; 1 disables ECMP.
+  size_t maxPaths = 4;
+  // Routes left in the kernel by a previous run keep forwarding for
+  // reconcileDelay while neighbors advertise them again, and are then
+  // replaced by the routing table.
+  std::chrono::milliseconds reconcileDelay{60000};
+  // See RouteAggregator.
+  std::vector<Prefix> summaries;
+  bool autoSummarize = false;
+};
+
+// Whether an enabled interface can carry routes, as last reported by the
+// kernel.
+struct InterfaceState {
+  bool linkUp = true;
+  bool hasAddress = true;
+};
+
+// Per-neighbor position in the neighbor's stream of table versions.
+struct NeighborState {
+  bool synced = false;
+  uint32_t seq = 0;
+  bool assembling = false;
+  uint32_t pendingSeq = 0;
+  uint16_t nextFragment = 0;
+  std::chrono::steady_clock::time_point lastRequest;
+};
+
+// A full dump (read from snapshot) or a delta (entries) to be encoded and
+// sent without holding the service mutex.
+struct Advertisement {
+  PacketHeader header;
+  std::shared_ptr<const RoutingTableSnapshot> snapshot;
+  // Sent after the snapshot's entries, if there is one.
+  std::vector<Entry> entries;
+  // Interfaces of all next hops of the multipath entries, by entry index.
+  std::map<size_t, std::vector<int>> multipathOifs;
 };
 
 class Service {
 public:
   Service(std::vector<EnabledInterface> enabledInterfaces,
-          std::vector<Entry> directRoutes);
+          std::vector<Entry> directRoutes, ServiceOptions options);
   void join();
+  // Returns the latest published routes, from any thread. Fetching them
+  // goes through a lock inside the standard library, so callers doing many
+  // lookups should keep one and look up routes in it.
+  std::shared_ptr<const RouteLookup> routeLookup() const;
+  // Finds the longest prefix reachable route covering addr in the latest
+  // published routes.
+  bool lookupRoute(in_addr addr, Entry &route) const;
 
 private:
+  void joinMulticastGroup(const std::vector<EnabledInterface> &enabledInterfaces,
+                          in_addr group);
   int findInterfaceByIp(struct in_addr addr);
-  void broadcastRoute(Entry entry);
-  void broadcastRoutingTable();
+  int findIngressInterface(msghdr &hdr, in_addr sender);
+  std::vector<Datagram> encodeAdvertisement(const Advertisement &advertisement);
+  Advertisement prepareFullDump();
+  Advertisement prepareDelta();
+  bool hasUnadvertisedChanges() const;
+  bool checkSequence(in_addr neighbor, const PacketHeader &header);
+  void requestFullDump(in_addr neighbor);
   void recvLoop();
   void broadcastLoop();
-  int findMetricByDst(in_addr dst);
-  void handleReceivedEntry(Entry entry);
-  void replaceEntry(in_addr dst, Entry newEntry);
+  void eventLoop();
+  int findMetric(in_addr dst, uint8_t dst_len);
+  size_t handleReceivedEntries(const std::vector<Entry> &entries,
+                               bool fullDumpRequested);
+  bool handleReceivedEntry(Entry entry);
+  void handleKernelEvent(const NetlinkEvent &event);
+  bool isInterfaceUp(int oif) const;
+  void interfaceDown(int oif);
+  void interfaceUp(int oif);
+  void reinstallRoutes();
+  void loadKernelRoutes();
+  void forgetKernelRoute(const RtMessage &route);
+  void reconcileKernelRoutes();
+  bool isKernelRoute(in_addr dst, uint8_t dst_len) const;
+  void replaceEntry(Entry newEntry);
+  void removeFromLpm(in_addr dst, uint8_t dst_len);
+  void publishRoutes();
+  void aggregateRoute(size_t slot);
+  void installRoute(size_t slot);
+  void flushRouteChanges();
+  void addPath(size_t slot, NextHop nextHop);
+  void removePath(size_t slot, size_t path);
+  std::chrono::steady_clock::time_point &heardTime(size_t slot, size_t path);
+  void scheduleTimeout(size_t slot);
+  void expireRoutes(std::chrono::steady_clock::time_point now);
+  void timeoutRoute(size_t slot);
+  void deleteRoute(size_t slot);
 
   std::mutex mutex;
+  std::condition_variable broadcastCv;
 
   std::thread recvThread;
   std::thread broadcastThread;
+  std::thread eventThread;
 
   int sfd;
 
+  ServiceOptions options;
+
+  FibWriter fibWriter;
+  // Kernel route changes not yet handed to fibWriter.
+  std::vector<RouteChange> fibChanges;
+  NetlinkEventSocket kernelEvents;
+  // While reconciling, the daemon's routes in the kernel, sorted by prefix;
+  // their prefixes are not written to until reconcileDeadline.
+  bool reconciling = false;
+  std::chrono::steady_clock::time_point reconcileDeadline;
+  std::vector<RtMessage> kernelRoutes;
+
   std::vector<EnabledInterface> enabledInterfaces;
-  std::vector<Entry> routingTable;
+  std::unordered_map<int, size_t> interfaceByIndex;
+  std::unordered_map<int, InterfaceState> interfaceStates;
+  std::vector<Entry> directRoutes;
+  InterfaceIndex interfaceIndex;
+  RoutingTable routingTable;
+  // Reachable routes only; routes at infinity wait for garbage collection
+  // outside of it.
+  Lpm lpm;
+  // Read and replaced with std::atomic_load and std::atomic_store.
+  std::shared_ptr<const RouteLookup> publishedRoutes;
+  uint64_t publishedVersion = 0;
+  RouteAggregator aggregator;
+  // Timeout or garbage collection timer of each learned route, by slot.
+  TimingWheel routeTimers;
+  // When each next hop of a learned route last advertised it, by slot and
+  // position among the route's next hops.
+  std::vector<std::chrono::steady_clock::time_point> pathHeard;
+  uint64_t advertisedVersion = 0;
+  bool fullDumpRequested = false;
+
+  std::map<in_addr_t, NeighborState> neighbors;
 };
@@ -0,0 +1,121 @@
+#include "TimingWheel.h"
+
+const uint32_t TimingWheel::noId;
+const uint16_t TimingWheel::noBucket;
+
+TimingWheel::TimingWheel(std::chrono::milliseconds tick,
+                         std::chrono::steady_clock::time_point start)
+    : heads(levels * bucketsPerLevel, noId) {
+  this->tick = tick;
+  this->start = start;
+  this->currentTick = 0;
+  this->count = 0;
+}
+
+void TimingWheel::schedule(uint32_t id,
+                           std::chrono::steady_clock::time_point deadline) {
+  if (id >= bucketOf.size()) {
+    size_t size = id + 1;
+    expires.resize(size);
+    bucketOf.resize(size, noBucket);
+    next.resize(size, noId);
+    prev.resize(size, noId);
+  }
+  cancel(id);
+
+  // Round up, so that a timer never fires before its deadline.
+  auto sinceStart = deadline - start;
+  uint64_t t = 0;
+  if (sinceStart.count() > 0)
+    t = (sinceStart + tick - std::chrono::nanoseconds{1}) / tick;
+  expires[id] = t;
+  link(id);
+  count++;
+}
+
+void TimingWheel::cancel(uint32_t id) {
+  if (!isScheduled(id))
+    return;
+  unlink(id);
+  count--;
+}
+
+// Puts id in the bucket for its deadline relative to the current tick.
+void TimingWheel::link(uint32_t id) {
+  uint64_t t = expires[id];
+  uint64_t delta = t > currentTick ? t - currentTick : 0;
+  if (delta == 0)
+    t = currentTick;
+
+  int level = 0;
+  while (level < levels - 1 && delta >> (levelBits * (level + 1)) != 0)
+    level++;
+  uint64_t span = (uint64_t)1 << (levelBits * levels);
+  if (delta >= span)
+    t = currentTick + span - 1;
+
+  uint32_t b = level * bucketsPerLevel +
+               ((t >> (levelBits * level)) & (bucketsPerLevel - 1));
+  bucketOf[id] = b;
+  prev[id] = noId;
+  next[id] = heads[b];
+  if (heads[b] != noId)
+    prev[heads[b]] = id;
+  heads[b] = id;
+}
+
+void TimingWheel::unlink(uint32_t id) {
+  uint32_t b = bucketOf[id];
+  if (prev[id] != noId)
+    next[prev[id]] = next[id];
+  else
+    heads[b] = next[id];
+  if (next[id] != noId)
+    prev[next[id]] = prev[id];
+  bucketOf[id] = noBucket;
+}
+
+// Redistributes the current bucket of level over the levels below it.
+void TimingWheel::cascade(int level) {
+  uint32_t b = level * bucketsPerLevel +
+               ((currentTick >> (levelBits * level)) & (bucketsPerLevel - 1));
+  uint32_t id = heads[b];
+  heads[b] = noId;
+  while (id != noId) {
+    uint32_t following = next[id];
+    link(id);
+    id = following;
+  }
+}
+
+void TimingWheel::advance(std::chrono::steady_clock::time_point now,
+                          std::vector<uint32_t> &expired) {
+  if (now < start)
+    return;
+  uint64_t target = (now - start) / tick;
+
+  while (currentTick <= target) {
+    for (int level = 1; level < levels; level++) {
+      uint64_t lowerTicks = ((uint64_t)1 << (levelBits * level)) - 1;
+      if ((currentTick & lowerTicks) != 0)
+        break;
+      cascade(level);
+    }
+
+    uint32_t b = currentTick & (bucketsPerLevel - 1);
+    uint32_t id = heads[b];
+    heads[b] = noId;
+    while (id != noId) {
+      uint32_t following = next[id];
+      bucketOf[id] = noBucket;
+      count--;
+      expired.push_back(id);
+      id = following;
+    }
+    currentTick++;
+  }
+}
+
+std::chrono::steady_clock::time_point TimingWheel::nextTick() const {
+  return start + tick * currentTick;
+}
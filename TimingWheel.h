@@ -0,0 +1,56 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// Hierarchical timing wheel holding at most one timer per id (e.g. a routing
+// table slot). Level 0 has one bucket per tick, and each level above covers
+// 64 times the span of the one below with the same number of buckets; timers
+// move one level down when their bucket comes up. Scheduling and cancelling
+// are O(1), and advancing costs O(1) per tick plus the timers that move or
+// expire, whatever the number of timers. Deadlines further than the top
+// level reaches are clamped to its end.
+class TimingWheel {
+public:
+  TimingWheel(std::chrono::milliseconds tick,
+              std::chrono::steady_clock::time_point start);
+
+  // (Re)arms the timer of id. Deadlines that have passed expire at the next
+  // tick.
+  void schedule(uint32_t id, std::chrono::steady_clock::time_point deadline);
+  void cancel(uint32_t id);
+  bool isScheduled(uint32_t id) const {
+    return id < bucketOf.size() && bucketOf[id] != noBucket;
+  }
+  size_t size() const { return count; }
+
+  // Runs the ticks up to now and appends the ids whose timers expired.
+  void advance(std::chrono::steady_clock::time_point now,
+               std::vector<uint32_t> &expired);
+  // Time of the next tick, when advance may expire timers again.
+  std::chrono::steady_clock::time_point nextTick() const;
+
+private:
+  static const int levelBits = 6;
+  static const uint32_t bucketsPerLevel = 1 << levelBits;
+  static const int levels = 4;
+  static const uint32_t noId = UINT32_MAX;
+  static const uint16_t noBucket = UINT16_MAX;
+
+  void link(uint32_t id);
+  void unlink(uint32_t id);
+  void cascade(int level);
+
+  std::chrono::milliseconds tick;
+  std::chrono::steady_clock::time_point start;
+  uint64_t currentTick;
+  size_t count;
+
+  // Per bucket: first id on its doubly linked list.
+  std::vector<uint32_t> heads;
+  // Per id: deadline in ticks, bucket and list links.
+  std::vector<uint64_t> expires;
+  std::vector<uint16_t> bucketOf;
+  std::vector<uint32_t> next;
+  std::vector<uint32_t> prev;
+};
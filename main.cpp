@@ -15,22 +15,44 @@
 
 using nlohmann::json;
 
+static SplitHorizon parseSplitHorizon(const std::string &s) {
+  if (s == "none")
+    return SplitHorizon::none;
+  if (s == "simple")
+    return SplitHorizon::simple;
+  if (s == "poisonedReverse")
+    return SplitHorizon::poisonedReverse;
+  throw std::runtime_error("unknown splitHorizon: " + s);
+}
+
+static Transport parseTransport(const std::string &s) {
+  if (s == "broadcast")
+    return Transport::broadcast;
+  if (s == "multicast")
+    return Transport::multicast;
+  throw std::runtime_error("unknown transport: " + s);
+}
+
 int main(int argc, char const *argv[]) {
   std::ifstream is{argv[1]};
   json configJson;
   is >> configJson;
 
   std::vector<EnabledInterface> enabledInterfaces;
-  for (auto enabledInterfaceJson : configJson["enabledInterfaces"]) {
+  for (const auto &enabledInterfaceJson : configJson["enabledInterfaces"]) {
     EnabledInterface iface;
     iface.addr = pton(enabledInterfaceJson["addr"]);
     iface.addr_len = enabledInterfaceJson["addr_len"];
     iface.oif = (int)enabledInterfaceJson["oif"];
+    iface.mtu = enabledInterfaceJson.value("mtu", 1500);
+    if (iface.mtu < minInterfaceMtu || iface.mtu > maxInterfaceMtu)
+      throw std::runtime_error("mtu out of range on interface " +
+                               std::to_string(iface.oif));
     enabledInterfaces.push_back(iface);
   }
 
   std::vector<Entry> directRoutes;
-  for (auto directRouteJson : configJson["directRoutes"]) {
+  for (const auto &directRouteJson : configJson["directRoutes"]) {
     Entry directRoute{};
     directRoute.dst = pton(directRouteJson["dst"]);
     directRoute.dst_len = directRouteJson["dst_len"];
@@ -38,12 +60,43 @@ int main(int argc, char const *argv[]) {
     directRoutes.push_back(directRoute);
   }
 
+  ServiceOptions options;
+  for (const auto &summaryJson : configJson.value("summaries", json::array())) {
+    Prefix summary;
+    summary.dst = pton(summaryJson["dst"]);
+    summary.dst_len = summaryJson["dst_len"];
+    options.summaries.push_back(summary);
+  }
+  options.autoSummarize = configJson.value("autoSummarize", false);
+  options.recvBatchSize = configJson.value("recvBatchSize", 64);
+  options.triggeredUpdateSuppression = std::chrono::milliseconds{
+      configJson.value("triggeredUpdateSuppressionMs", 1000)};
+  options.fullDumpEvery = configJson.value("fullDumpEvery", 10);
+  options.splitHorizon =
+      parseSplitHorizon(configJson.value("splitHorizon", "poisonedReverse"));
+  options.broadcastInterval = std::chrono::milliseconds{
+      configJson.value("broadcastIntervalMs", 30000)};
+  options.broadcastJitter =
+      std::chrono::milliseconds{configJson.value("broadcastJitterMs", 5000)};
+  options.maxPacketsPerSecond = configJson.value("maxPacketsPerSecond", 1000.0);
+  options.packetBurst = configJson.value("packetBurst", 64);
+  options.transport = parseTransport(configJson.value("transport", "broadcast"));
+  options.multicastGroup = pton(configJson.value("multicastGroup", "224.0.0.9"));
+  options.hugePages = configJson.value("hugePages", false);
+  options.routeTimeout =
+      std::chrono::milliseconds{configJson.value("routeTimeoutMs", 180000)};
+  options.garbageCollectionTimeout = std::chrono::milliseconds{
+      configJson.value("garbageCollectionTimeoutMs", 120000)};
+  options.maxPaths = configJson.value("maxPaths", 4);
+  options.reconcileDelay =
+      std::chrono::milliseconds{configJson.value("reconcileDelayMs", 60000)};
+
   std::cerr << "Enabled interfaces:" << std::endl;
-  for (auto ei : enabledInterfaces) {
+  for (const auto &ei : enabledInterfaces) {
     std::cerr << to_string(ei.addr) << "/" << (int)ei.addr_len << " dev "
               << ei.oif << std::endl;
   }
 
-  Service service{enabledInterfaces, directRoutes};
+  Service service{enabledInterfaces, directRoutes, options};
   service.join();
 }
@@ -1,6 +1,7 @@
 #include <arpa/inet.h>
 #include <netinet/ip.h>
 
+#include <cstdint>
 #include <stdexcept>
 #include <string>
 
@@ -20,3 +21,8 @@ inline std::string to_string(in_addr addr) {
 inline bool operator==(in_addr a, in_addr b) { return a.s_addr == b.s_addr; }
 
 inline bool operator!=(in_addr a, in_addr b) { return !(a == b); }
+
+// Host order netmask for a prefix length in [0, 32].
+inline uint32_t prefixMask(uint8_t len) {
+  return len == 0 ? 0 : ~uint32_t{0} << (32 - len);
+}